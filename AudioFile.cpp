@@ -3,54 +3,183 @@
  *   - block-aligned reads for optimal playback
  *   - metadata hiding for near-seemless transitions (FLAC and MP3)
  *   - metadata parsing for supported file types
+ *   - moov-before-mdat ordering for MP4 files that are not optimized for streaming
+ *   - embedded cover art left out of WMA headers
  *
  */
 
+#include <util/atomic.h>
 #include "AudioFile.h"
+#include "SPIBus.h"
+
+uint8_t AudioFile::tags[NUM_TAGS][MAX_TAG_LENGTH + 1];
+const uint8_t AudioFile::noTag = 0;
+
+#ifdef SPISTATSMODE
+// block of the open file last read into the SD cache, the card is only timed for others
+static uint32_t cachedBlock = UINT32_MAX;
+#endif
 
 AudioFile::AudioFile() {
   buffer = SdVolume::cacheClear();
-
-  for (uint8_t i = 0; i < NUM_TAGS; i++) {
-    tags[i].reserve(MAX_TAG_LENGTH);
-  }
+  type = OTHER;
 }
 
 
 AudioFile& AudioFile::operator=(const File &file) {
   File::operator=(file);
+#ifdef SPISTATSMODE
+  cachedBlock = UINT32_MAX;
+#endif
   return *this;
 }
 
 
 void AudioFile::close() {
+  // a WMA header is patched in the cache until the stream jumps past what's left out
+  if (type == ASF && from) {
+    SdVolume::cacheClear();
+  }
+
   // reset properties
   type = OTHER;
+  from = 0;
+  to = 0;
+#ifdef SPISTATSMODE
+  cachedBlock = UINT32_MAX;
+#endif
 
   for (uint8_t i = 0; i < NUM_TAGS; i++) {
-    tags[i] = "";
+    tags[i][0] = 0;
   }
 
   File::close();
 }
 
 
-// read ascii tag value directly from buffer
-void AudioFile::readTag(uint8_t tag, uint16_t ssize) {
-  uint16_t j = position() % 512;
-  read();
+// read the next byte at the cursor
+// loads the next block only when the cached one is used up
+uint8_t AudioFile::next() {
+  if (avail == 0) {
+    avail = readBlock(cursor);
+    if (avail == 0) {
+      return 0;
+    }
+  }
+
+  avail--;
+  return *cursor++;
+}
+
+
+// read the next n bytes at the cursor
+void AudioFile::next(void *buf, uint8_t n) {
+  uint8_t *p = (uint8_t *) buf;
+
+  while (n-- > 0) {
+    *p++ = next();
+  }
+}
+
+
+// advance the cursor, staying in the cached block if possible
+void AudioFile::skip(uint32_t n) {
+  if (n < avail) {
+    cursor += n;
+    avail -= n;
+  } else {
+    seek(position() + n - avail);
+    avail = 0;
+  }
+}
+
+
+// move the cursor to an absolute file position
+void AudioFile::seekTo(uint32_t pos) {
+  uint32_t cur = tell();
+
+  if (pos >= cur) {
+    skip(pos - cur);
+  } else if (avail > 0 && cur - pos <= (uint16_t) (cursor - buffer)) {
+    // still in the cached block
+    cursor -= cur - pos;
+    avail += cur - pos;
+  } else {
+    seek(pos);
+    avail = 0;
+  }
+}
+
+
+// map a code point to the SID character set, 0 if it can't be shown
+static char sidChar(uint32_t cp) {
+  if (' ' <= cp && cp <= '~') {
+    return cp;
+  } else if (0x00a0 <= cp && cp <= 0x00ff) {
+    return pgm_read_byte(SidLatin1 + cp - 0x00a0);
+  } else if (0x2010 <= cp && cp <= 0x201f) {
+    return pgm_read_byte(SidPunctuation + cp - 0x2010);
+  }
 
-  for (uint16_t i = 0; i < ssize && tags[tag].length() < MAX_TAG_LENGTH; i++) {
-    // advance file position
-    if (j == 512) {
-      seek(position() + 511);
-      read();
-      j = 0;
+  return 0;
+}
+
+
+// decode tag value directly from buffer
+void AudioFile::readTag(uint8_t tag, uint16_t ssize, Encoding enc) {
+  uint8_t *text = tags[tag];
+  uint32_t cp = 0;
+  uint8_t more = 0;
+
+  // a size running past the end of the file means garbage
+  if (ssize > size() - tell()) {
+    ssize = size() - tell();
+  }
+
+  // byte order mark
+  if (enc == UTF16 && ssize >= 2) {
+    enc = (next() == 0xff) ? UTF16LE : UTF16BE;
+    next();
+    ssize -= 2;
+  }
+
+  while (ssize-- > 0 && text[0] < MAX_TAG_LENGTH) {
+    uint8_t c = next();
+
+    switch (enc) {
+      case Latin1:
+        cp = c;
+        break;
+
+      case UTF8:
+        if (c < 0x80) {
+          // single byte
+          cp = c;
+          more = 0;
+        } else if (c < 0xc0) {
+          // continuation byte
+          if (more == 0) continue;
+          cp = (cp << 6) | (c & 0x3f);
+          if (--more > 0) continue;
+        } else {
+          // lead byte
+          more = (c < 0xe0) ? 1 : (c < 0xf0) ? 2 : 3;
+          cp = c & (0x3f >> more);
+          continue;
+        }
+        break;
+
+      default:
+        // two bytes per code unit, surrogates are dropped
+        if (ssize-- == 0) return;
+        cp = next();
+        cp = (enc == UTF16LE) ? (cp << 8 | c) : (c << 8 | cp);
+        break;
     }
 
-    char c = buffer[j++];
-    if (' ' <= c && c <= '~') {
-      tags[tag] += c;
+    char s = sidChar(cp);
+    if (s) {
+      text[++text[0]] = s;
     }
   }
 }
@@ -63,54 +192,62 @@ void AudioFile::readId3Tags() {
   uint32_t tag_size;
 
   // major version
-  uint8_t ver = read();
+  uint8_t ver = next();
 
   // minor version and flags
-  seek(position() + 2);
+  skip(2);
 
   // header size
-  read(buffer, 4);
-  header_end = position() + BE7x4(buffer);
+  next(buffer, 4);
+  header_end = tell() + BE7x4(buffer);
 
   // search through tags
   do {
     if (ver >= 3) {
       // get id
-      read(tag, ID3V23_ID);
+      next(tag, ID3V23_ID);
 
       // get size
-      read(buffer, 4);
+      next(buffer, 4);
       tag_size = (ver > 3) ? BE7x4(buffer) : BE8x4(buffer);
 
       // skip flags
-      seek(position() + 2);
+      skip(2);
     } else {
       // get id
-      read(tag, ID3V20_ID);
+      next(tag, ID3V20_ID);
 
       // get size
-      read(buffer, 3);
+      next(buffer, 3);
       tag_size = BE8x3(buffer);
     }
 
+    // a tag running past the header means garbage
+    if (tell() > header_end || tag_size > header_end - tell()) {
+      break;
+    }
+
     // locate next tag
-    uint32_t skip = position() + tag_size;
+    uint32_t skip_to = tell() + tag_size;
 
     // store it if it's one we care about
     for (uint8_t i = 0; i < NUM_TAGS; i++) {
       if (ver >= 3 ? !strncasecmp_P(tag, (Id3v23Fields + i * ID3V23_ID), ID3V23_ID)
                    : !strncasecmp_P(tag, (Id3v20Fields + i * ID3V20_ID), ID3V20_ID)) {
-        readTag(i, tag_size);
+        if (tag_size > 0) {
+          uint8_t enc = next();
+          readTag(i, tag_size - 1, (enc <= UTF8) ? (Encoding) enc : Latin1);
+        }
         break;
       }
     }
 
     // next tag
-    seek(skip);
-  } while (tag_size > 0 && position() < header_end);
+    seekTo(skip_to);
+  } while (tag_size > 0 && tell() < header_end);
 
   // skip to the end
-  seek(header_end);
+  seekTo(header_end);
 }
 
 
@@ -120,38 +257,42 @@ void AudioFile::readVorbisComments() {
   uint32_t tag_size;
 
   // vendor comments
-  read(buffer, 4);
+  next(buffer, 4);
   tag_size = LE8x4(buffer);
-  seek(position() + tag_size);
+  skip(tag_size);
 
   // number of tags
-  read(buffer, 4);
+  next(buffer, 4);
   tag_count = LE8x4(buffer);
 
-  // search through tags
-  while (tag_count-- > 0 && this) {
+  // search through tags, the count can't be trusted past the end of the file
+  while (tag_count-- > 0 && this && tell() < size()) {
     // read field size
-    read(buffer, 4);
+    next(buffer, 4);
     tag_size = LE8x4(buffer);
+    if (tag_size > size() - tell()) {
+      break;
+    }
 
     // locate next tag
-    uint32_t skip = position() + tag_size;
+    uint32_t skip_to = tell() + tag_size;
 
     // read tag name
-    read(buffer, VORBIS_ID);
-    uint8_t delim = (uint16_t) memchr(buffer, '=', VORBIS_ID) - (uint16_t) &buffer + 1;
+    next(buffer, VORBIS_ID);
+    char *eq = (char *) memchr(buffer, '=', VORBIS_ID);
+    uint8_t delim = (eq && eq - buffer < tag_size) ? eq - buffer + 1 : 0;
 
     // store it if it's one we care about
-    for (uint8_t i = 0; i < NUM_TAGS; i++) {
+    for (uint8_t i = 0; delim && i < NUM_TAGS; i++) {
       if (!strncasecmp_P(buffer, (VorbisFields + i * VORBIS_ID), delim)) {
-        seek(position() - (VORBIS_ID - delim));
-        readTag(i, tag_size - delim);
+        seekTo(tell() - (VORBIS_ID - delim));
+        readTag(i, tag_size - delim, UTF8);
         break;
       }
     }
 
     // next tag
-    seek(skip);
+    seekTo(skip_to);
   }
 }
 
@@ -165,7 +306,7 @@ int AudioFile::readFlac() {
   // read metablocks
   do {
     // block header
-    read(buffer, 4);
+    next(buffer, 4);
     block_type = buffer[0] & 0x7F;
     last_block = buffer[0] & 0x80;
     block_size = BE8x3((buffer + 1));
@@ -173,8 +314,8 @@ int AudioFile::readFlac() {
     // block data
     switch (block_type) {
       case 0: // streaminfo
-        seek(position() + block_size);
-        return position();
+        skip(block_size);
+        return tell();
 
       case 4: // vorbis_comment
         // process comment block
@@ -182,7 +323,7 @@ int AudioFile::readFlac() {
         break;
 
       default:
-        seek(position() + block_size);
+        skip(block_size);
         break;
     }
   } while (!last_block && this);
@@ -196,29 +337,30 @@ void AudioFile::readOgg() {
   uint16_t seg_size;
 
   // skip header info
-  seek(26);
+  seekTo(26);
 
   // size of segment table
-  seg_count = read();
+  seg_count = next();
 
   // read segment table
   seg_size = 0;
   while (seg_count-- > 0) {
-    seg_size += read();
+    seg_size += next();
   }
 
   // skip to the next block
-  seek(position() + seg_size + 26);
+  skip(seg_size + 26);
 
   // skip segment table
-  seg_count = read();
-  seek(position() + seg_count + 7);
+  seg_count = next();
+  skip(seg_count + 7);
 
-  // process comment block
+  // process comment block, cover art in it is sent along since
+  // pages can only be left out whole and it shares its packet with the tags
   readVorbisComments();
 
   // rewind
-  seek(0);
+  seekTo(0);
 }
 
 
@@ -227,103 +369,126 @@ void AudioFile::readAsf() {
   char buffer[GUID];
 
   // Object ID & Size
-  seek(GUID + 8);
+  seekTo(GUID + 8);
 
   // Number of Header Objects
-  read(buffer, 4);
+  next(buffer, 4);
   uint32_t object_count = LE8x4(buffer);
 
   // Reserved Bytes
-  seek(position() + 2);
+  skip(2);
 
   // for each object
   while (object_count-- > 0 && this) {
+    uint32_t object = tell();
     uint32_t next_object;
 
-    read(buffer, GUID);
+    next(buffer, GUID);
     if (!memcmp_P(buffer, ASF_Content_Description_Object, GUID)) {
       // Object Size
-      read(buffer, 4);
-      next_object = position() - 20 + LE8x4(buffer);
-      seek(position() + 4);
+      next(buffer, 4);
+      next_object = tell() - 20 + LE8x4(buffer);
+      skip(4);
 
       // Title Length
-      read(buffer, 2);
+      next(buffer, 2);
       uint16_t title_size = LE8x2(buffer);
 
       // Author Length
-      read(buffer, 2);
+      next(buffer, 2);
       uint16_t artist_size = LE8x2(buffer);
 
       // Copyright + Description + Rating Length
-      seek(position() + 6);
+      skip(6);
 
       // Title
-      uint32_t skip = position() + title_size;
-      readTag(Title, title_size);
-      seek(skip);
+      uint32_t skip_to = tell() + title_size;
+      readTag(Title, title_size, UTF16LE);
+      seekTo(skip_to);
 
       // Author
-      readTag(Artist, artist_size);
+      readTag(Artist, artist_size, UTF16LE);
     }
     else if (!memcmp_P(buffer, ASF_Extended_Content_Description_Object, GUID)) {
       // Object Size
-      read(buffer, 4);
-      next_object = position() - 20 + LE8x4(buffer);
-      seek(position() + 4);
+      next(buffer, 4);
+      next_object = tell() - 20 + LE8x4(buffer);
+      skip(4);
 
       // Content Descriptors Count
-      read(buffer, 2);
+      next(buffer, 2);
       uint16_t tag_count = LE8x2(buffer);
 
-      while (tag_count-- > 0) {
+      while (tag_count-- > 0 && tell() < next_object) {
         // Descriptor Name Length
-        read(buffer, 2);
+        next(buffer, 2);
         uint16_t name_size = LE8x2(buffer);
 
-        // Descriptor Name & Value Data Type
-        uint32_t skip = position() + name_size + 2;
+        // Descriptor Name
+        uint32_t skip_to = tell() + name_size;
         name_size /= 2;
         if (name_size > ASF_ID) {
           name_size = ASF_ID;
         }
         for (uint8_t j = 0; j < name_size; j++) {
-          read((buffer + j), 2);
+          next((buffer + j), 2);
         }
-        seek(skip);
+        seekTo(skip_to);
 
-        // Descriptor Value Length
+        // Descriptor Value Data Type
         char w[2];
-        read(w, 2);
+        next(w, 2);
+        uint16_t value_type = LE8x2(w);
+
+        // Descriptor Value Length
+        next(w, 2);
         uint16_t value_size = LE8x2(w);
 
         // Descriptor Value
-        skip = position() + value_size;
+        skip_to = tell() + value_size;
+
+        // only a name ending in its terminator can match in full
+        if (name_size == 0 || buffer[name_size - 1] != '\0') {
+          seekTo(skip_to);
+          continue;
+        }
+
+        // leave this object out if it has cover art
+        if (name_size == sizeof(AsfPicture) && !memcmp_P(buffer, AsfPicture, sizeof(AsfPicture))) {
+          from = object;
+          to = next_object;
+        }
 
         // store it if it's one we care about
         for (uint8_t i = 0; i < NUM_TAGS; i++) {
-          if (!strncmp_P(buffer, (AsfFields + i * ASF_ID), name_size)) {
-            readTag(i, value_size);
+          if (!strcmp_P(buffer, (AsfFields + i * ASF_ID))) {
+            // only unicode strings
+            if (value_type == 0) {
+              readTag(i, value_size, UTF16LE);
+            }
             break;
           }
         }
 
         // next Descriptor
-        seek(skip);
+        seekTo(skip_to);
       }
     }
     else {
       // Object Size
-      read(buffer, 4);
-      next_object = position() - 20 + LE8x4(buffer);
+      next(buffer, 4);
+      next_object = tell() - 20 + LE8x4(buffer);
     }
 
-    // next Object
-    seek(next_object);
+    // next Object, one smaller than its header means garbage
+    if (next_object < object + GUID + 8) {
+      break;
+    }
+    seekTo(next_object);
   }
 
   // rewind
-  seek(0);
+  seekTo(0);
 }
 
 
@@ -335,45 +500,104 @@ void AudioFile::readQtff() {
 
   do {
     // atom size
-    read(buffer, 4);
-    next_atom = position() - 4 + BE8x4(buffer);
+    next(buffer, 4);
+    next_atom = tell() - 4 + BE8x4(buffer);
 
     // atom name
-    read(buffer, 4);
+    next(buffer, 4);
+
+    // sizes smaller than the header would go backwards,
+    // 0 (to the end) and 1 (64-bit) aren't used for tags
+    if (next_atom < tell()) {
+      break;
+    }
 
     // if we're not in tag list
     if (depth < 4) {
       // determine if this atom is in the path to tags
       if (!memcmp_P(buffer, (iTunesPath + depth * QTFF_ID), QTFF_ID)) {
+        if (depth == 0 && from) {
+          // 'moov' follows 'mdat'
+          to = tell() - 8;
+        }
         if (depth++ == 2) {
           // skip 'meta' version info
-          seek(position() + 4);
+          skip(4);
         }
         parent_atom = next_atom;
       } else {
+        // note where 'mdat' starts in case 'moov' comes later
+        if (depth == 0 && !memcmp_P(buffer, QtffMediaData, QTFF_ID)) {
+          from = tell() - 8;
+        }
+
         // skip to next atom
-        seek(next_atom);
+        seekTo(next_atom);
       }
     } else {
       // read tag value
       for (uint8_t i = 0; i < NUM_TAGS; i++) {
         if (!memcmp_P(buffer, (iTunesFields + i * QTFF_ID), QTFF_ID)) {
           // skip to 'data' value
-          seek(position() + 16);
-          uint16_t value_size = next_atom - position();
-          readTag(i, value_size);
+          skip(16);
+          uint16_t value_size = next_atom - tell();
+          readTag(i, value_size, UTF8);
           break;
         }
       }
 
       // next tag
-      seek(next_atom);
+      seekTo(next_atom);
     }
 
-  } while (position() < parent_atom);
+  } while (tell() < parent_atom);
+
+  // 'moov' was found first, nothing to rearrange
+  if (!to) {
+    from = 0;
+  }
 
   // rewind
-  seek(0);
+  seekTo(0);
+}
+
+
+// stream 'moov' ahead of 'mdat' so the codec sees it first
+// returns a pointer to the buffer and the number of bytes read
+int AudioFile::readMoov(uint8_t *&buf) {
+  uint32_t pos = position();
+
+  if (pos == from) {
+    // atoms before 'mdat' are done, continue with 'moov'
+    char buffer[4];
+    seek(to);
+    read(buffer, 4);
+    end = to + BE8x4(buffer);
+    seek(to);
+  } else if (pos == end) {
+    // 'moov' is done, play 'mdat' up to 'moov'
+    seek(from);
+    end = to;
+    return 0;
+  }
+
+  return readBlock(buf);
+}
+
+
+// stream up to the region being left out, then jump past it
+// returns a pointer to the buffer and the number of bytes read
+int AudioFile::readAround(uint8_t *&buf) {
+  if (position() == end) {
+    // don't leave a patched header in the cache
+    SdVolume::cacheClear();
+
+    seek(to);
+    end = size();
+    return 0;
+  }
+
+  return readBlock(buf);
 }
 
 
@@ -383,12 +607,12 @@ void AudioFile::readDsf() {
 
   // read ID3v2 tags
   if (metadata != 0) {
-    seek(metadata + 3);
+    seekTo(metadata + 3);
     readId3Tags();
   }
 
   // rewind
-  seek(0);
+  seekTo(0);
 }
 
 
@@ -398,18 +622,27 @@ int AudioFile::readMetadata(uint8_t *&buf) {
   int siz = 0;
   buf = buffer;
 
+  // closed under us, position() and name() no longer make sense
+  if (!*this) {
+    return 0;
+  }
+
   // start
   if (position() == 0) {
-    read();
+    end = size();
+    avail = 0;
+    next();
 
     // look for supported magic numbers
     switch(BE8x4(buffer)) {
       case 0x0000001c:
       case 0x00000020:
-        seek(BE8x4(buffer));
+        seekTo(BE8x4(buffer));
+        type = MP4;
         readQtff();
         break;
       case 0x3026b275:
+        type = ASF;
         readAsf();
         break;
       case 0x44534420:
@@ -419,39 +652,71 @@ int AudioFile::readMetadata(uint8_t *&buf) {
       case 0x49443302:
       case 0x49443303:
       case 0x49443304:
-        seek(3);
+        seekTo(3);
         readId3Tags();
         break;
       case 0x4f676753:
         readOgg();
         break;
       case 0x664c6143:
-        seek(4);
+        seekTo(4);
         type = FLAC;
         siz = readFlac();
         break;
       default:
-        seek(0);
+        seekTo(0);
         break;
     }
 
+    // send everything up to the first jump
+    if (from) {
+      seek(tell());
+      avail = 0;
+
+      end = from;
+      siz = readBlock(buf);
+
+      if (type == ASF) {
+        // shrink the Header Object by what's left out
+        uint32_t header_size = LE8x4((buf + 16)) - (to - from);
+        uint32_t object_count = LE8x4((buf + 24)) - 1;
+        for (uint8_t i = 0; i < 4; i++) {
+          buf[16 + i] = header_size >> (8 * i);
+          buf[24 + i] = object_count >> (8 * i);
+        }
+      }
+    }
+
   // continue
   } else {
     switch (type) {
       case FLAC:
         readFlac();
         break;
+      case MP4:
+        siz = readMoov(buf);
+        break;
+      case ASF:
+        siz = readAround(buf);
+        break;
     }
   }
 
   // done
   if (siz == 0) {
     // use file name if no title found
-    if (tags[Title].length() == 0) {
-      tags[Title] = name();
+    if (tags[Title][0] == 0) {
+      const char *n = name();
+      uint8_t len = min(strlen(n), MAX_TAG_LENGTH);
+      memcpy(tags[Title] + 1, n, len);
+      tags[Title][0] = len;
     }
   }
 
+  // leave the file where the cursor is
+  seek(tell());
+  avail = 0;
+
   return siz;
 }
 
@@ -463,8 +728,29 @@ int AudioFile::readBlock(uint8_t *&buf) {
   uint16_t rem = pos % 512;
   uint16_t siz = 512 - rem;
 
+  // stop at the end of the current extent
+  if (pos + siz > end) {
+    siz = (pos < end) ? end - pos : 0;
+  }
+
   // ensure the block we need is in cache
+#ifdef SPISTATSMODE
+  // time blocks that aren't cached yet, less the interrupts taken meanwhile
+  if (pos / 512 != cachedBlock) {
+    uint32_t start = micros();
+    uint32_t isr = SPIBus.interruptTime();
+    read();
+    uint32_t elapsed = micros() - start - (SPIBus.interruptTime() - isr);
+    cachedBlock = pos / 512;
+    ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+      SPIBus.add(SPI_CARD, elapsed);
+    }
+  } else {
+    read();
+  }
+#else
   read();
+#endif
   buf = buffer + rem;
 
   // move to the next block or EOF
@@ -479,24 +765,25 @@ int AudioFile::readBlock(uint8_t *&buf) {
 }
 
 
-// jump to a relative position in the audio file based on a given
-// number of seconds and VS1053 calculated byterate
-// returns true if successful
-bool AudioFile::jump(int16_t secs, uint16_t rate) {
-  int32_t bytes;
-
-  // calculate number of bytes to jump
+// bytes per second of audio given the VS1053 calculated byterate
+uint32_t AudioFile::byteRate(uint16_t rate) {
   switch (type) {
     case FLAC:
-      bytes = secs * (int32_t)rate * (int32_t)4;
-      break;
+      return (uint32_t)rate * 4;
     case DSF:
-      bytes = secs * (int32_t)352800;
-      break;
+      return 352800;
     default:
-      bytes = secs * (int32_t)(rate & 0xfffc);
-      break;
+      return rate & 0xfffc;
   }
+}
+
+
+// jump to a relative position in the audio file based on a given
+// number of seconds and VS1053 calculated byterate
+// returns true if successful
+bool AudioFile::jump(int16_t secs, uint16_t rate) {
+  // calculate number of bytes to jump
+  int32_t bytes = secs * (int32_t)byteRate(rate);
 
   // update position
   return seek(position() + bytes);
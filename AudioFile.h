@@ -2,7 +2,12 @@
 #define AUDIOFILE_H
 #include <SD.h>
 
+// longest tag kept, longer text scrolls on the SID, each character costs
+// NUM_TAGS + 1 bytes of RAM in the tag arena and the CDC scroll ring,
+// 40 takes 112 bytes more than 24
+#ifndef MAX_TAG_LENGTH
 #define MAX_TAG_LENGTH 24
+#endif
 
 // various macros to interpret multi-byte integers
 #define BE7x4(x) (((uint32_t)((uint8_t)x[0])) << 21 | ((uint32_t)((uint8_t)x[1])) << 14 | ((uint32_t)((uint8_t)x[2])) << 7 | ((uint32_t)((uint8_t)x[3])))
@@ -11,6 +16,20 @@
 #define LE8x4(x) (((uint32_t)((uint8_t)x[3])) << 24 | ((uint32_t)((uint8_t)x[2])) << 16 | ((uint32_t)((uint8_t)x[1])) << 8 | ((uint32_t)((uint8_t)x[0])))
 #define LE8x2(x) (((uint16_t)((uint8_t)x[1])) << 8 | ((uint16_t)((uint8_t)x[0])))
 
+// read-only view of a length-prefixed tag in the tag arena
+class TagText
+{
+  public:
+    TagText(const uint8_t *text) : text(text) {}
+    uint8_t length() const { return text[0]; }
+    char operator[](uint8_t i) const {
+      return (i < text[0]) ? text[i + 1] : '\0';
+    }
+
+  private:
+    const uint8_t *text;
+};
+
 class AudioFile : public File
 {
   public:
@@ -23,20 +42,41 @@ class AudioFile : public File
     int readMetadata(uint8_t *&buf);
     int readBlock(uint8_t *&buf);
     bool jump(int16_t secs, uint16_t rate);
+    uint32_t byteRate(uint16_t rate);
     bool isHighBitRate() { return type == FLAC || type == DSF; }
-    const String &getTag(Tag tag) {
-      return tags[ tag < NUM_TAGS ? tag : NUM_TAGS ];
+    TagText getTag(Tag tag) {
+      return TagText(tag < NUM_TAGS ? tags[tag] : &noTag);
     }
     uint8_t *fillBuffer(uint8_t c, size_t n) {
       return (uint8_t *) memset(buffer, c, n);
     }
 
   private:
-    enum Type : uint8_t { FLAC, DSF, OTHER } type;
+    enum Type : uint8_t { FLAC, DSF, MP4, ASF, OTHER } type;
     uint8_t *buffer;
-    String tags[NUM_TAGS + 1];
 
-    void readTag(uint8_t tag, uint16_t ssize);
+    // tag arena, each entry is a length followed by text
+    static uint8_t tags[NUM_TAGS][MAX_TAG_LENGTH + 1];
+    static const uint8_t noTag;
+
+    // playback extents, the stream jumps from one position to another
+    uint32_t end;
+    uint32_t from;
+    uint32_t to;
+
+    // cursor into the cached block
+    uint8_t *cursor;
+    uint16_t avail;
+    uint8_t next();
+    void next(void *buf, uint8_t n);
+    void skip(uint32_t n);
+    void seekTo(uint32_t pos);
+    uint32_t tell() { return position() - avail; }
+
+    // text encodings, the first four match ID3v2
+    enum Encoding : uint8_t { Latin1, UTF16, UTF16BE, UTF8, UTF16LE };
+
+    void readTag(uint8_t tag, uint16_t ssize, Encoding enc);
     void readId3Tags();
     void readVorbisComments();
     int readFlac();
@@ -44,8 +84,25 @@ class AudioFile : public File
     void readQtff();
     void readAsf();
     void readDsf();
+    int readMoov(uint8_t *&buf);
+    int readAround(uint8_t *&buf);
 };
 
+// SID replacements for U+00A0 - U+00FF, 0 to drop
+const char SidLatin1[] PROGMEM =
+  " !cL$Y|S\"Ca<-" "\0" "R-"
+  "o+23'uP.,1o>" "\0\0\0" "?"
+  "AAAAAAACEEEEIIII"
+  "DNOOOOOxOUUUUYPs"
+  "aaaaaaaceeeeiiii"
+  "dnooooo/ouuuuypy";
+static_assert(sizeof(SidLatin1) == 0x60 + 1, "one replacement per code point");
+
+// SID replacements for U+2010 - U+201F
+const char SidPunctuation[] PROGMEM =
+  "------|_'','\"\"\"\"";
+static_assert(sizeof(SidPunctuation) == 0x10 + 1, "one replacement per code point");
+
 #define VORBIS_ID 12
 const char VorbisFields[] PROGMEM = 
   "TITLE=      "
@@ -85,6 +142,8 @@ const char iTunesFields[] PROGMEM =
 const char iTunesPath[] PROGMEM =
   "moov""udta""meta""ilst";
 
+const char QtffMediaData[] PROGMEM = "mdat";
+
 #define ASF_ID 15
 const char AsfFields[] PROGMEM =
   "Title\x0         "
@@ -94,6 +153,8 @@ const char AsfFields[] PROGMEM =
   "WM/Genre\x0      "
   "WM/Year\x0       ";
 
+const char AsfPicture[] PROGMEM = "WM/Picture";
+
 #define GUID 16
 const byte ASF_Header_Object[] PROGMEM =
   {0x30,0x26,0xB2,0x75,0x8E,0x66,0xCF,0x11,0xA6,0xD9,0x00,0xAA,0x00,0x62,0xCE,0x6C};
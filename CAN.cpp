@@ -1,69 +1,66 @@
 /*
  *  CAN implements CAN 2.0A (standard) interface for MCP2515 and related controllers
  *      based on work by Fabian Greif and Igor Real
- *   - Uses SPI transactions to allow bus sharing
+ *   - Uses SPI transactions to allow bus sharing, batched in the interrupt handler
  *   - Optionally use RX0BF or RX1BF to manage transceiver or mode indicator
  *
  */
 
-#include <SPI.h>
-#include <utility/Sd2PinMap.h>
 #include "CAN.h"
+#include "SPIBus.h"
+#include "Latency.h"
 
-#define MCP2515_SPI_SETTING SPISettings(10000000, MSBFIRST, SPI_MODE0)
+typedef SPIChip<MCP2515_CS, 10000000, SPI_MODE0, SPI_CAN> MCP2515;
 
 CANClass CAN;
 
-// setup pins, set CAN bus speed, optionally set filters, begin accepting messages
-void CANClass::begin(uint16_t speed, const uint16_t high[] PROGMEM, const uint16_t low[] PROGMEM) {
-  pinMode(MCP2515_CS, OUTPUT);
-  digitalWrite(MCP2515_CS, HIGH);
+// place a standard id into SIDH/SIDL/EID8/EID0 register values
+static void setId(uint8_t reg[], uint16_t id) {
+  reg[0] = id >> 3;
+  reg[1] = id << 5;
+  reg[2] = 0x00;
+  reg[3] = 0x00;
+}
+
+
+// setup pins, set CAN bus timing, optionally set filters, begin accepting messages
+// returns false if the controller did not take the configuration
+bool CANClass::begin(uint8_t cnf1, uint8_t cnf2, uint8_t cnf3, const uint16_t high[] PROGMEM, const uint16_t low[] PROGMEM) {
+  MCP2515::setup();
 
   pinMode(MCP2515_IRQ, INPUT);
 
   SPI.begin();
 
   // reset MCP2515 to clear registers and put it into configuration mode
-  SPI.beginTransaction(MCP2515_SPI_SETTING);
-  fastDigitalWrite(MCP2515_CS, LOW);
+  MCP2515::begin();
+  MCP2515::select();
 
-  spiwrite(SPI_RESET);
+  MCP2515::write(SPI_RESET);
 
-  fastDigitalWrite(MCP2515_CS, HIGH);
-  SPI.endTransaction();
+  MCP2515::deselect();
+  MCP2515::end();
 
   // wait for reset to complete
   delayMicroseconds(10);
 
-  // configure bus speed
-  uint8_t cnf1, cnf2, cnf3;
-  switch (speed) {
-    case 47:
-      // https://forum.microchip.com/s/topic/a5C3l000000Lyo8EAC/t225476
-      cnf1 = 0xc7; cnf2 = 0xbe; cnf3 = 0x04;
-      break;
-    case 500:
-      cnf1 = 0x01; cnf2 = 0x90; cnf3 = 0x02;
-      break;
-    case 250:
-      cnf1 = 0x01; cnf2 = 0xB8; cnf3 = 0x05;
-      break;
-    case 125:
-      cnf1 = 0x07; cnf2 = 0x90; cnf3 = 0x02;
-      break;
-    case 100:
-      cnf1 = 0x03; cnf2 = 0xBA; cnf3 = 0x07;
-      break;
-    default:
-      cnf1 = 0x00; cnf2 = 0x90; cnf3 = 0x02;
-      break;
+  if ((readRegister(CANSTAT) & (_BV(REQOP2) | _BV(REQOP1) | _BV(REQOP0))) != Config) {
+    return false;
   }
-  writeRegister(CNF1, cnf1);
-  writeRegister(CNF2, cnf2);
-  writeRegister(CNF3, cnf3);
 
-  // always interrupt on high priority RX
-  writeRegister(CANINTE, _BV(RX0IE));
+  // bus speed and interrupts, always interrupt on high priority RX and completed TX
+  const uint8_t config[] = { cnf3, cnf2, cnf1,
+    _BV(RX0IE) | _BV(TX2IE) | _BV(TX1IE) | _BV(TX0IE) };
+  if (!writeRegisters(CNF3, config, sizeof(config))) {
+    return false;
+  }
+
+  // same priority for every TX buffer, order is kept by flush()
+  writeRegister(TXB0CTRL, _BV(TXP1) | _BV(TXP0));
+  writeRegister(TXB1CTRL, _BV(TXP1) | _BV(TXP0));
+  writeRegister(TXB2CTRL, _BV(TXP1) | _BV(TXP0));
+  txPending = 0;
+  txTail = txHead;
 
   // allow rollover from RXB0 to RXB1
   modifyRegister(RXB0CTRL, _BV(BUKT), _BV(BUKT));
@@ -71,74 +68,99 @@ void CANClass::begin(uint16_t speed, const uint16_t high[] PROGMEM, const uint16
   // enable RXnBF registers for output
   writeRegister(BFPCTRL, _BV(B1BFE) | _BV(B0BFE));
 
-  // configure filters
-  setFilters(high, low);
-
-  // leave config mode
-  setMode(ListenOnly);
+  // configure filters and leave config mode
+  return setFilters(high, low) && setMode(ListenOnly);
 }
 
 
-// transmit a message in FIFO order
-// returns true if buffered successfully
+// queue a message for transmission in FIFO order, flush() starts it
+// returns true if queued successfully
 bool CANClass::send(const msg &message) {
-  static uint8_t id;
-  uint8_t status = readStatus(SPI_READ_STATUS);
-
-  // reset id if all buffers are clear
-  if ((status & 0b01010100) == 0) {
-    id = 14;
-  }
-
-  // calculate TX buffer address
-  uint8_t address = (id & 0b11) << 1;
-
-  // if that buffer isn't available we're done
-  if (bit_is_set(status, address + 2)) {
+  uint8_t next = (txHead + 1) & (CAN_TX_QUEUE - 1);
+  if (next == txTail) {
     return false;
   }
 
-  SPI.beginTransaction(MCP2515_SPI_SETTING);
-  fastDigitalWrite(MCP2515_CS, LOW);
+  txQueue[txHead] = message;
+  txHead = next;
 
-  // select buffer
-  spiwrite(SPI_WRITE_TX | address);
+  return true;
+}
 
-  // standard id
-  spiwrite(message.id >> 3);
-  spiwrite(message.id << 5);
 
-  // no extended id
-  spiwrite(0x00);
-  spiwrite(0x00);
+// acknowledge completed transmissions and start the next batch
+// call from the interrupt handler
+void CANClass::flush() {
+  // one transaction for the whole exchange
+  MCP2515::begin();
 
-  // DLC
-  uint8_t length = message.header.length;
-  if (message.header.rtr) {
-    spiwrite(_BV(RTR) | length);
-  } else {
-    spiwrite(length);
+  // nothing in flight, no TX interrupt to look for
+  if (txPending) {
+    uint8_t status = readStatus(SPI_READ_STATUS);
+
+    uint8_t done = 0;
+    if (bit_is_set(status, 3)) done |= _BV(0);
+    if (bit_is_set(status, 5)) done |= _BV(1);
+    if (bit_is_set(status, 7)) done |= _BV(2);
 
-    // data
-    for (uint8_t t = 0; t < length; t++) {
-      spiwrite(message.data[t]);
+    if (done) {
+      // TXnIF sits two bits above the matching RTS bit
+      modifyRegister(CANINTF, done << 2, 0x00);
+      txPending &= ~done;
     }
   }
 
-  fastDigitalWrite(MCP2515_CS, HIGH);
-  SPI.endTransaction();
+  if (txPending || txTail == txHead) {
+    MCP2515::end();
+    return;
+  }
 
-  // calculate the control register and priority
-  uint8_t ctrlreg = (address << 3) + TXB0CTRL;
-  uint8_t priority = id >> 2;
+  // equal priorities go out from the highest buffer down,
+  // so filling TXB2 first keeps FIFO order
+  uint8_t buffer = 2;
+  uint8_t frames = 0;
+  do {
+    load(buffer, txQueue[txTail]);
+    txTail = (txTail + 1) & (CAN_TX_QUEUE - 1);
+    txPending |= _BV(buffer);
+    frames++;
+  } while (buffer-- && txTail != txHead);
 
-  // flag the buffer for transmission
-  modifyRegister(ctrlreg, _BV(TXREQ) | _BV(TXP1) | _BV(TXP0), _BV(TXREQ) | priority);
+  // request to send the whole batch
+  MCP2515::select();
 
-  // decrement id, skipping invalid addresses
-  id -= (id % 4) ? 1 : 2;
+  MCP2515::write(SPI_RTS | txPending);
 
-  return true;
+  MCP2515::deselect();
+  MCP2515::end();
+
+#ifdef LATENCYMODE
+  Latency.sent(frames);
+#endif
+}
+
+
+// load a message into a TX buffer without flagging it for transmission
+void CANClass::load(uint8_t buffer, const msg &message) {
+  MCP2515::begin();
+  MCP2515::select();
+
+  // select buffer
+  MCP2515::write(SPI_WRITE_TX | (buffer << 1));
+
+  // standard id, no extended id, DLC
+  uint8_t length = message.header.length;
+  const uint8_t header[] = { (uint8_t) (message.id >> 3), (uint8_t) (message.id << 5), 0x00, 0x00,
+    (uint8_t) (message.header.rtr ? _BV(RTR) | length : length) };
+  MCP2515::write(header, sizeof(header));
+
+  // data
+  if (!message.header.rtr) {
+    MCP2515::write(message.data, length);
+  }
+
+  MCP2515::deselect();
+  MCP2515::end();
 }
 
 
@@ -146,6 +168,8 @@ bool CANClass::send(const msg &message) {
 // returns true if a message was received
 bool CANClass::receive(msg &message) {
   uint8_t address;
+
+  MCP2515::begin();
   uint8_t status = readStatus(SPI_RX_STATUS);
 
   // buffer 0 has the higher priority
@@ -157,44 +181,44 @@ bool CANClass::receive(msg &message) {
     address = 0x04;
   } else {
     // no message available
+    MCP2515::end();
     return false;
   }
 
-  SPI.beginTransaction(MCP2515_SPI_SETTING);
-  fastDigitalWrite(MCP2515_CS, LOW);
+  MCP2515::select();
 
-  spiwrite(SPI_READ_RX | address);
+  MCP2515::write(SPI_READ_RX | address);
 
   // standard id
-  uint8_t sidh = spiread();
-  uint8_t sidl = spiread();
+  uint8_t sidh = MCP2515::read();
+  uint8_t sidl = MCP2515::read();
   message.id = (sidh << 3) | (sidl >> 5);
 
   // skip extended id
-  spiread();
-  spiread();
+  MCP2515::read();
+  MCP2515::read();
 
-  // DLC
-  uint8_t length = spiread() & 0x0f;
+  // DLC, values over 8 still mean 8 bytes
+  uint8_t length = MCP2515::read() & 0x0f;
+  if (length > 8) length = 8;
   message.header.length = length;
   message.header.rtr = bit_is_set(sidl, SRR);
 
   // data
   if (!message.header.rtr) {
-    for (uint8_t t = 0; t < length; t++) {
-      message.data[t] = spiread();
-    }
+    MCP2515::read(message.data, length);
   }
 
-  fastDigitalWrite(MCP2515_CS, HIGH);
-  SPI.endTransaction();
+  MCP2515::deselect();
+  MCP2515::end();
 
   return true;
 }
 
 
 // change the operating mode of the can chip
-void CANClass::setMode(Mode mode) {
+// returns false if the controller did not change mode in time
+bool CANClass::setMode(Mode mode) {
   switch (mode) {
     case Normal:
       // transceiver on
@@ -219,147 +243,157 @@ void CANClass::setMode(Mode mode) {
   // set controller mode
   modifyRegister(CANCTRL, _BV(REQOP2) | _BV(REQOP1) | _BV(REQOP0), mode);
 
-  // wait until controller mode has been changed
-  while ((readRegister(CANSTAT) & (_BV(REQOP2) | _BV(REQOP1) | _BV(REQOP0))) != mode);
+  // wait until controller mode has been changed,
+  // sleep waits for the bus to go idle so allow a few frame times
+  uint8_t polls = CAN_MODE_POLLS;
+  while ((readRegister(CANSTAT) & (_BV(REQOP2) | _BV(REQOP1) | _BV(REQOP0))) != mode) {
+    if (--polls == 0) {
+      return false;
+    }
+    delayMicroseconds(20);
+  }
 
   if (mode != Normal) {
     // transceiver standby
     modifyRegister(BFPCTRL, _BV(B1BFS) | _BV(B0BFS), _BV(B1BFS) | _BV(B0BFS));
   }
+
+  return true;
 }
 
 
 // enable/disable standard id filtering
 // high: NULL for no filter or an array in PROGMEM containing 2 id's followed by a mask
 // low: NULL for no filter or an array in PROGMEM containing 4 id's followed by a mask
-void CANClass::setFilters(const uint16_t high[] PROGMEM, const uint16_t low[] PROGMEM) {
-  uint16_t filter;
+// returns false if the filters did not read back
+bool CANClass::setFilters(const uint16_t high[] PROGMEM, const uint16_t low[] PROGMEM) {
+  uint8_t filters[12] = {};
+  uint8_t masks[8] = {};
   uint8_t flags;
+  bool ok;
 
-  // RXB0: enable/disable filters
+  // RXF0-RXF2: high priority filter id's and the first low priority one
   if (high) {
-    // set high priority filter id's
-    filter = pgm_read_word_near(high + 0);
-    writeRegister(RXF0SIDH, filter >> 3);
-    writeRegister(RXF0SIDL, filter << 5);
-
-    filter = pgm_read_word_near(high + 1);
-    writeRegister(RXF1SIDH, filter >> 3);
-    writeRegister(RXF1SIDL, filter << 5);
-
-    // set high pirority bit mask
-    filter = pgm_read_word_near(high + 2);
-    writeRegister(RXM0SIDH, filter >> 3);
-    writeRegister(RXM0SIDL, filter << 5);
-
-    // accept only id's that match the filters
-    flags = 0;
-  } else {
-    // accept all messages
-    flags = _BV(RXM1) | _BV(RXM0);
+    setId(filters + 0, pgm_read_word_near(high + 0));
+    setId(filters + 4, pgm_read_word_near(high + 1));
+    setId(masks + 0, pgm_read_word_near(high + 2));
   }
-  modifyRegister(RXB0CTRL, _BV(RXM1) | _BV(RXM0), flags);
+  if (low) {
+    setId(filters + 8, pgm_read_word_near(low + 0));
+  }
+  ok = writeRegisters(RXF0SIDH, filters, sizeof(filters));
 
-  // RXB1: enable/disable filters
+  // RXF3-RXF5: remaining low priority filter id's
   if (low) {
-    // set low priority filter id's
-    filter = pgm_read_word_near(low + 0);
-    writeRegister(RXF2SIDH, filter >> 3);
-    writeRegister(RXF2SIDL, filter << 5);
-
-    filter = pgm_read_word_near(low + 1);
-    writeRegister(RXF3SIDH, filter >> 3);
-    writeRegister(RXF3SIDL, filter << 5);
-
-    filter = pgm_read_word_near(low + 2);
-    writeRegister(RXF4SIDH, filter >> 3);
-    writeRegister(RXF4SIDL, filter << 5);
-
-    filter = pgm_read_word_near(low + 3);
-    writeRegister(RXF5SIDH, filter >> 3);
-    writeRegister(RXF5SIDL, filter << 5);
-
-    // set low priority bit mask
-    filter = pgm_read_word_near(low + 4);
-    writeRegister(RXM1SIDH, filter >> 3);
-    writeRegister(RXM1SIDL, filter << 5);
-
-    // accept only id's that match the filters
-    flags = 0;
-  } else {
-    // accept all messages
-    flags = _BV(RXM1) | _BV(RXM0);
+    setId(filters + 0, pgm_read_word_near(low + 1));
+    setId(filters + 4, pgm_read_word_near(low + 2));
+    setId(filters + 8, pgm_read_word_near(low + 3));
+    setId(masks + 4, pgm_read_word_near(low + 4));
   }
+  ok = writeRegisters(RXF3SIDH, filters, sizeof(filters)) && ok;
+
+  // RXM0-RXM1: bit masks
+  ok = writeRegisters(RXM0SIDH, masks, sizeof(masks)) && ok;
+
+  // RXB0: accept only id's that match the filters or all messages
+  flags = high ? 0 : _BV(RXM1) | _BV(RXM0);
+  modifyRegister(RXB0CTRL, _BV(RXM1) | _BV(RXM0), flags);
+
+  // RXB1: accept only id's that match the filters or all messages
+  flags = low ? 0 : _BV(RXM1) | _BV(RXM0);
   modifyRegister(RXB1CTRL, _BV(RXM1) | _BV(RXM0), flags);
+
+  return ok;
 }
 
 
 void CANClass::writeRegister( uint8_t address, uint8_t data ) {
-  SPI.beginTransaction(MCP2515_SPI_SETTING);
-  fastDigitalWrite(MCP2515_CS, LOW);
+  MCP2515::begin();
+  MCP2515::select();
 
-  spiwrite(SPI_WRITE);
-  spiwrite(address);
-  spiwrite(data);
+  MCP2515::write(SPI_WRITE);
+  MCP2515::write(address);
+  MCP2515::write(data);
 
-  fastDigitalWrite(MCP2515_CS, HIGH);
-  SPI.endTransaction();
+  MCP2515::deselect();
+  MCP2515::end();
+}
+
+
+// write consecutive registers in one transaction and read them back
+// returns true if every register holds what was written
+bool CANClass::writeRegisters(uint8_t address, const uint8_t data[], uint8_t length) {
+  MCP2515::begin();
+  MCP2515::select();
+
+  MCP2515::write(SPI_WRITE);
+  MCP2515::write(address);
+  MCP2515::write(data, length);
+
+  MCP2515::deselect();
+
+  // read back
+  MCP2515::select();
+
+  bool ok = true;
+  MCP2515::write(SPI_READ);
+  MCP2515::write(address);
+  for (uint8_t i = 0; i < length; i++) {
+    if (MCP2515::read() != data[i]) {
+      ok = false;
+    }
+  }
+
+  MCP2515::deselect();
+  MCP2515::end();
+
+  return ok;
 }
 
 
 uint8_t CANClass::readStatus(uint8_t type) {
   uint8_t data;
 
-  SPI.beginTransaction(MCP2515_SPI_SETTING);
-  fastDigitalWrite(MCP2515_CS, LOW);
+  MCP2515::begin();
+  MCP2515::select();
 
-  spiwrite(type);
-  data = spiread();
+  MCP2515::write(type);
+  data = MCP2515::read();
 
-  fastDigitalWrite(MCP2515_CS, HIGH);
-  SPI.endTransaction();
+  MCP2515::deselect();
+  MCP2515::end();
 
   return data;
 }
 
 
 void CANClass::modifyRegister(uint8_t address, uint8_t mask, uint8_t data) {
-  SPI.beginTransaction(MCP2515_SPI_SETTING);
-  fastDigitalWrite(MCP2515_CS, LOW);
+  MCP2515::begin();
+  MCP2515::select();
 
-  spiwrite(SPI_BIT_MODIFY);
-  spiwrite(address);
-  spiwrite(mask);
-  spiwrite(data);
+  MCP2515::write(SPI_BIT_MODIFY);
+  MCP2515::write(address);
+  MCP2515::write(mask);
+  MCP2515::write(data);
 
-  fastDigitalWrite(MCP2515_CS, HIGH);
-  SPI.endTransaction();
+  MCP2515::deselect();
+  MCP2515::end();
 }
 
 
 uint8_t CANClass::readRegister(uint8_t address) {
   uint8_t data;
 
-  SPI.beginTransaction(MCP2515_SPI_SETTING);
-  fastDigitalWrite(MCP2515_CS, LOW);
+  MCP2515::begin();
+  MCP2515::select();
 
-  spiwrite(SPI_READ);
-  spiwrite(address);
-  data = spiread();
+  MCP2515::write(SPI_READ);
+  MCP2515::write(address);
+  data = MCP2515::read();
 
-  fastDigitalWrite(MCP2515_CS, HIGH);
-  SPI.endTransaction();
+  MCP2515::deselect();
+  MCP2515::end();
 
   return data;
 }
 
-
-inline __attribute__((always_inline))
-uint8_t CANClass::spiread() {
-  return SPI.transfer(0x00);
-}
-
-inline __attribute__((always_inline))
-void CANClass::spiwrite(uint8_t c) {
-  SPI.transfer(c);
-}
@@ -6,6 +6,10 @@
 #define MCP2515_CS     10
 #define MCP2515_IRQ    2
 #define MCP2515_INT    digitalPinToInterrupt(MCP2515_IRQ)
+#define MCP2515_OSC    16000000
+#define CAN_TX_QUEUE   8    // messages waiting for a TX buffer, power of 2
+#define CAN_MODE_POLLS 250  // CANSTAT reads, 20us apart, before a mode change fails
+#define CAN_MAX_ERROR  5000 // bitrate error allowed by CANTiming, in ppm
 
 
 //----------------------------------------------------------------------------
@@ -268,6 +272,70 @@
 #define	DLC1		1
 #define DLC0		0
 
+//----------------------------------------------------------------------------
+// BIT TIMING
+//----------------------------------------------------------------------------
+
+// CNF1/CNF2/CNF3 for a bitrate, solved at compile time
+//   Osc: oscillator frequency in Hz
+//   Bitrate: bus speed in bits/s
+//   SamplePoint: wanted sample point in percent of the bit time
+// picks the least bitrate error, then the most time quanta per bit
+template <uint32_t Osc, uint32_t Bitrate, uint8_t SamplePoint = 75>
+class CANTiming {
+  private:
+    // time quanta per bit for a baud rate prescaler
+    static constexpr uint32_t quanta(uint8_t brp) {
+      return (Osc + (brp + 1) * Bitrate) / (2 * (brp + 1) * Bitrate);
+    }
+
+    // time quanta up to and including the sample point
+    static constexpr uint32_t sample(uint32_t tq) {
+      return (tq * SamplePoint + 50) / 100;
+    }
+
+    // bitrate error in ppm
+    static constexpr uint32_t error(uint8_t brp) {
+      return (Osc > 2 * (brp + 1) * Bitrate * quanta(brp)
+          ? Osc - 2 * (brp + 1) * Bitrate * quanta(brp)
+          : 2 * (brp + 1) * Bitrate * quanta(brp) - Osc) * 1000000ULL / Osc;
+    }
+
+    // sync + propagation + phase 1 and phase 2 fit the registers
+    static constexpr bool fits(uint8_t brp) {
+      return quanta(brp) >= 5 && quanta(brp) <= 25
+          && sample(quanta(brp)) >= 3 && sample(quanta(brp)) <= 17
+          && quanta(brp) - sample(quanta(brp)) >= 2 && quanta(brp) - sample(quanta(brp)) <= 8
+          && sample(quanta(brp)) - 1 >= quanta(brp) - sample(quanta(brp));
+    }
+
+    // search prescalers from brp up, found is 0xff until one fits
+    static constexpr uint8_t solve(uint8_t brp, uint8_t found) {
+      return brp > 63 ? found
+          : solve(brp + 1, fits(brp) && (found > 63 || error(brp) < error(found)) ? brp : found);
+    }
+
+  public:
+    static constexpr uint8_t brp = solve(0, 0xff);
+    static constexpr uint8_t tq = quanta(brp);
+    static constexpr uint8_t ps2 = tq - sample(tq);
+    static constexpr uint8_t ps1 = sample(tq) - 2 < 8 ? sample(tq) - 2 : 8;
+    static constexpr uint8_t prop = sample(tq) - 1 - ps1;
+    static constexpr uint8_t sjw = ps2 - 1 < 4 ? ps2 - 1 : 4;
+
+    static constexpr uint8_t samplePoint = sample(tq) * 100 / tq;
+    static constexpr uint32_t errorPpm = error(brp);
+
+    static constexpr uint8_t cnf1 = ((sjw - 1) << 6) | brp;
+    static constexpr uint8_t cnf2 = _BV(BTLMODE) | ((ps1 - 1) << 3) | (prop - 1);
+    static constexpr uint8_t cnf3 = ps2 - 1;
+
+    static_assert(brp < 64, "no MCP2515 bit timing for this oscillator and bitrate");
+    static_assert(errorPpm <= CAN_MAX_ERROR, "bitrate error too large");
+    static_assert(sjw >= 1 && ps2 > sjw, "MCP2515 needs PS2 longer than SJW");
+    static_assert(samplePoint + 5 >= SamplePoint && samplePoint <= SamplePoint + 5, "sample point too far from target");
+};
+
 //----------------------------------------------------------------------------
 // CLASS
 //----------------------------------------------------------------------------
@@ -283,8 +351,14 @@ class CANClass {
       uint8_t data[8];
     } msg;
 
-    void begin(uint16_t speed, const uint16_t high[] PROGMEM = NULL, const uint16_t low[] PROGMEM = NULL);
+    // Timing: a CANTiming for the bus
+    template <class Timing>
+    bool begin(const uint16_t high[] PROGMEM = NULL, const uint16_t low[] PROGMEM = NULL) {
+      return begin(Timing::cnf1, Timing::cnf2, Timing::cnf3, high, low);
+    }
     bool send(const msg &message);
+    void flush();
+    uint8_t queued() { return (txHead - txTail) & (CAN_TX_QUEUE - 1); };
     bool receive(msg &message);
     bool available() { return !fastDigitalRead(MCP2515_IRQ); };
     uint8_t getSendErrors() { return readRegister(TEC); }
@@ -296,18 +370,26 @@ class CANClass {
     }
 
     enum Mode : uint8_t { Normal = 0x00, Sleep = 0x20, Loopback = 0x40, ListenOnly = 0x60, Config = 0x80 };
-    void setMode(Mode mode);
+    bool setMode(Mode mode);
 
   private:
-    void setFilters(const uint16_t high[] PROGMEM, const uint16_t low[] PROGMEM);
+    bool begin(uint8_t cnf1, uint8_t cnf2, uint8_t cnf3, const uint16_t high[] PROGMEM, const uint16_t low[] PROGMEM);
+    bool setFilters(const uint16_t high[] PROGMEM, const uint16_t low[] PROGMEM);
+    void load(uint8_t buffer, const msg &message);
+
+    // messages waiting for a TX buffer
+    msg txQueue[CAN_TX_QUEUE];
+    uint8_t txHead;
+    uint8_t txTail;
+
+    // TX buffers waiting to complete, as RTS bits
+    uint8_t txPending;
 
     uint8_t readStatus(uint8_t type);
     uint8_t readRegister(uint8_t address);
     void writeRegister(uint8_t address, uint8_t data);
+    bool writeRegisters(uint8_t address, const uint8_t data[], uint8_t length);
     void modifyRegister(uint8_t address, uint8_t mask, uint8_t data);
-
-    void spiwrite(uint8_t);
-    uint8_t spiread();
 };
 
 //----------------------------------------------------------------------------
@@ -8,6 +8,8 @@
 #include <SD.h>
 #include <util/atomic.h>
 #include "CDC.h"
+#include "Latency.h"
+#include "Trace.h"
 
 CDCClass CDC;
 
@@ -23,6 +25,9 @@ void CDCClass::setup() {
     t |= analogRead(0) & 1;
   }
   seed = t ? t : 1;
+
+  // no display tags
+  rows[0] = rows[1] = AudioFile::NUM_TAGS;
 }
 
 
@@ -31,6 +36,9 @@ void CDCClass::begin() {
   // turn on sound card
   VS1053::begin();
 
+  // drop commands left over from before
+  tail = head;
+
   // open SD card
   if (SD.begin(25000000, SD_CS)
       && (path[0].h = SD.open("/"))) {
@@ -42,6 +50,11 @@ void CDCClass::begin() {
     // read presets
     readPresets(F("PRESETS.TXT"));
 
+#ifdef TRACEMODE
+    // continue the CAN trace
+    Trace.begin();
+#endif
+
     // promote ready state
     if (state == Busy) {
       state = Paused;
@@ -55,6 +68,10 @@ void CDCClass::end() {
   // resume current track on start-up
   next = current;
 
+#ifdef TRACEMODE
+  Trace.end();
+#endif
+
   // close SD card
   while (depth > 0) {
     path[depth--].h.close();
@@ -72,18 +89,25 @@ void CDCClass::end() {
 // main playback loop
 void CDCClass::loop() {
   if (state >= Busy) {
+    publish(true);
     begin();
 
     while (state >= Paused) {
       // get the next track if one hasn't already been selected
+      update();
       if (next == UNKNOWN) {
-        skipTrack();
+        selectTrack();
       }
       openTrack();
+#ifdef LATENCYMODE
+      Latency.mark(LatencyClass::Opened);
+#endif
+      publish(true);
       playTrack();
     }
 
     end();
+    publish(true);
   }
 }
 
@@ -96,10 +120,7 @@ void CDCClass::on() {
 
 
 void CDCClass::off() {
-  if (state >= Paused) {
-    state = Busy;
-    stopTrack();
-  }
+  post(PowerOff);
 }
 
 
@@ -119,6 +140,14 @@ void CDCClass::shuffle() {
 
 
 void CDCClass::skipTrack(int8_t sign) {
+#ifdef LATENCYMODE
+  Latency.start();
+#endif
+  post(SkipTrack, sign);
+}
+
+
+void CDCClass::selectTrack(int8_t sign) {
   if (shuffled) {
     if (sign > 0) {
       if (next == UNKNOWN) {
@@ -148,10 +177,10 @@ void CDCClass::skipTrack(int8_t sign) {
 
 
 void CDCClass::nextDisc() {
-  if (next == UNKNOWN) {
-    next = path[depth].last;
-    stopTrack();
-  }
+#ifdef LATENCYMODE
+  if (!shuffled) Latency.start();
+#endif
+  post(NextDisc);
 }
 
 
@@ -180,16 +209,273 @@ void CDCClass::readPresets(const __FlashStringHelper* fileName) {
 
 
 void CDCClass::preset(uint8_t memory) {
-  if (next == UNKNOWN) {
-    next = presets[memory];
-    stopTrack();
-  }
+#ifdef LATENCYMODE
+  if (!shuffled) Latency.start();
+#endif
+  post(Preset, memory);
 }
 
 
 void CDCClass::skipTime(int8_t seconds) {
   state = Rapid;
-  skip(seconds);
+  post(SkipTime, seconds);
+}
+
+
+// queue a command from interrupt context, dropped if the queue is full
+void CDCClass::post(Command cmd, int8_t arg) {
+  uint8_t h = head;
+  uint8_t n = (h + 1) & (QUEUE_SIZE - 1);
+
+  if (n != tail) {
+    queue[h].cmd = cmd;
+    queue[h].arg = arg;
+    head = n;
+  }
+}
+
+
+// apply queued commands and keep the status current
+void CDCClass::update() {
+  bool changed = false;
+
+  while (tail != head) {
+    changed = true;
+
+    uint8_t t = tail;
+    Command cmd = queue[t].cmd;
+    int8_t arg = queue[t].arg;
+    tail = (t + 1) & (QUEUE_SIZE - 1);
+#ifdef LATENCYMODE
+    Latency.mark(LatencyClass::Applied);
+#endif
+
+    switch (cmd) {
+      case SkipTrack:
+        selectTrack(arg);
+        break;
+
+      case SkipTime:
+        skip(arg);
+        break;
+
+      case NextDisc:
+        if (shuffled) {
+          // rotate a single display tag
+          rows[0] = (rows[0] + 1) % (AudioFile::NUM_TAGS + 1);
+          rows[1] = AudioFile::NUM_TAGS;
+          render();
+        } else if (next == UNKNOWN) {
+          next = path[depth].last;
+          stopTrack();
+        }
+        break;
+
+      case Preset:
+        if (shuffled) {
+          if ((uint8_t) arg == rows[0] || (uint8_t) arg == rows[1]) {
+            // hide display
+            rows[0] = rows[1] = AudioFile::NUM_TAGS;
+          } else if (rows[0] == AudioFile::NUM_TAGS) {
+            // show a tag on both rows
+            rows[0] = arg;
+          } else {
+            // push a tag onto the lower row
+            if (rows[1] != AudioFile::NUM_TAGS) rows[0] = rows[1];
+            rows[1] = arg;
+          }
+          render();
+        } else if (next == UNKNOWN) {
+          next = presets[(uint8_t) arg];
+          stopTrack();
+        }
+        break;
+
+      case PowerOff:
+        if (state >= Paused) {
+          state = Busy;
+          stopTrack();
+        }
+        break;
+    }
+  }
+
+  publish(changed);
+
+#ifdef TRACEMODE
+  // the card can hold up the playback loop, only use it if the codec can wait
+  Trace.update(Trace.needsCard() && spareTime() >= TRACE_CARD_MS);
+#endif
+}
+
+
+// apply a queued power off ahead of the commands before it,
+// for loops that can't stop for the others
+// returns true if playback is ending
+bool CDCClass::stopping() {
+  for (uint8_t t = tail; t != head; t = (t + 1) & (QUEUE_SIZE - 1)) {
+    if (queue[t].cmd == PowerOff && state >= Paused) {
+      state = Busy;
+    }
+  }
+
+  return state < Paused;
+}
+
+
+// update the status buffer not being read, then flip to it
+void CDCClass::publish(bool now) {
+  static uint16_t last;
+
+  uint16_t ms = millis();
+  if (!now && (uint16_t) (ms - last) < STATUS_MS) {
+    return;
+  }
+  last = ms;
+
+  uint8_t i = (seq + 1) & 1;
+  status[i].disc = discNumber();
+  status[i].track = trackNumber();
+  status[i].time = trackTime();
+  seq++;
+}
+
+
+// track metadata is in, show it
+void CDCClass::started() {
+#ifdef LATENCYMODE
+  Latency.mark(LatencyClass::Metadata);
+#endif
+  render();
+}
+
+
+// SID display position, 12 on row 1 then 11 on row 2, to its byte in the frames
+static uint8_t *textSlot(uint8_t frames[6][8], uint8_t pos) {
+  if (pos < 12) {
+    return &frames[pos / 5][3 + pos % 5];
+  } else {
+    return &frames[3 + (pos - 12) / 5][3 + (pos - 12) % 5];
+  }
+}
+
+
+// fill width display positions from first with text starting at from
+// returns the index of the next character
+static uint8_t layout(uint8_t frames[6][8], uint8_t first, uint8_t width, const TagText &text, uint8_t from = 0) {
+  for (uint8_t i = 0; i < width; i++) {
+    *textSlot(frames, first + i) = text[from + i];
+  }
+  return from + width;
+}
+
+
+// build the SID text frames for the display tags and swap in the rows that changed
+void CDCClass::render() {
+  const TagText upper = audio.getTag((AudioFile::Tag) rows[0]);
+  const TagText lower = audio.getTag((AudioFile::Tag) rows[1]);
+  bool dual = rows[1] < AudioFile::NUM_TAGS;
+  uint8_t frames[6][8] = {};
+
+  for (uint8_t f = 0; f < 6; f++) {
+    frames[f][1] = 0x96;
+
+    // row id
+    frames[f][2] = (f < 3) ? 1 : 2;
+  }
+  frames[5][4] = rows[dual] + 1;
+
+  // copy text, what doesn't fit scrolls over its display positions
+  TagText scroll = upper;
+  uint8_t first = 0;
+  uint8_t width = 0;
+  if (dual) {
+    layout(frames, 0, 12, upper);
+    layout(frames, 12, 11, lower);
+    if (lower.length() > 11) {
+      scroll = lower;
+      first = 12;
+      width = 11;
+    } else if (upper.length() > 12) {
+      width = 12;
+    }
+  } else {
+    uint8_t i = layout(frames, 0, 12, upper);
+    if (upper[i] == ' ') i++;
+    i = layout(frames, 12, 11, upper, i);
+    if (i < upper.length()) {
+      width = 23;
+    }
+  }
+  uint8_t length = width ? scroll.length() + SCROLL_GAP : 0;
+
+  ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+    // different scrolling text starts over on both rows
+    bool moved = length != scrollLength || first != scrollFirst || width != scrollWidth;
+    for (uint8_t j = 0; j < length; j++) {
+      char c = (j < scroll.length()) ? scroll[j] : ' ';
+      if (scrollRing[j] != c) {
+        scrollRing[j] = c;
+        moved = true;
+      }
+    }
+    if (moved) {
+      scrollLength = length;
+      scrollFirst = first;
+      scrollWidth = width;
+      scrollOffset = 0;
+    }
+
+    for (uint8_t row = 0; row < 2; row++) {
+      uint8_t *rendered = frames[row * 3];
+      volatile uint8_t *current = textFrames[row * 3];
+      if (moved || memcmp(rendered, (const uint8_t *) current, 3 * 8)) {
+        memcpy((uint8_t *) current, rendered, 3 * 8);
+        textVersion[row]++;
+      }
+    }
+    textShown = upper.length() > 0 || lower.length() > 0;
+  }
+}
+
+
+// copy SID text frame i, in send order, at the current scroll position
+void CDCClass::getTextFrame(uint8_t i, uint8_t data[8]) {
+  memcpy(data, (const uint8_t *) textFrames[i], 8);
+
+  if (scrollLength) {
+    // display position and number of characters in this frame
+    uint8_t p = (i < 3) ? 5 * i : 5 * i - 3;
+    uint8_t n = (i == 2) ? 2 : (i == 5) ? 1 : 5;
+
+    for (uint8_t j = 3; j < 3 + n; j++, p++) {
+      // position in the scroll window, wraps out of range below it
+      uint8_t q = p - scrollFirst;
+      if (q < scrollWidth) {
+        q += scrollOffset;
+        if (q >= scrollLength) q -= scrollLength;
+        data[j] = scrollRing[q];
+      }
+    }
+  }
+}
+
+
+// move scrolling text on by one character
+// returns the rows that changed as bits
+uint8_t CDCClass::scrollText() {
+  if (!scrollLength) {
+    return 0;
+  }
+
+  if (++scrollOffset == scrollLength) {
+    scrollOffset = 0;
+  }
+
+  if (scrollFirst >= 12) {
+    return 0b10;
+  }
+  return (scrollWidth > 12) ? 0b11 : 0b01;
 }
 
 
@@ -237,6 +523,14 @@ void CDCClass::openTrack() {
       // enumerate files in this folder
       entry = path[depth].h.openNextFile();
       while (entry) {
+        publish();
+
+        // a large folder takes a while, power off doesn't wait for it
+        if (stopping()) {
+          entry.close();
+          return;
+        }
+
         if (entry.isDirectory()) {
           // flag hasFolders
           hasFolders = true;
@@ -6,9 +6,12 @@
 
 #define SD_CS         4    // SD card SPI select pin (output)
 #define NUM_PRESETS   6
+#define QUEUE_SIZE    8    // pending commands, power of 2
+#define STATUS_MS     50   // interval between status updates
+#define SCROLL_GAP    3    // spaces between the end and start of scrolling text
 
 // filesystem stuff
-#define UNKNOWN       -1
+#define UNKNOWN       0xffff
 #define MAX_DEPTH     3
 
 class CDCClass : private VS1053
@@ -29,12 +32,45 @@ class CDCClass : private VS1053
     void nextDisc();
     void preset(uint8_t memory);
 
-    // status
+    // status, safe to read from interrupt context, state and shuffle are
+    // single bytes set by the interrupt itself, so they're read live
     State getState() { return state; };
     bool isShuffled() { return shuffled; };
-    uint16_t getTime() { return trackTime(); };
+    uint16_t getTime() { return status[seq & 1].time; };
+    uint8_t getTrack() { return status[seq & 1].track; };
+    uint8_t getDisc() { return status[seq & 1].disc; };
+
+    // SID text frames for the display tags, safe to read from interrupt context
+    bool hasText() { return textShown; };
+    uint8_t getTextVersion(uint8_t row) { return textVersion[row]; };
+    void getTextFrame(uint8_t i, uint8_t data[8]);
+    uint8_t scrollText();
+
+#ifdef STREAMMODE
+    // codec input of the last track, safe to read from interrupt context
+    uint8_t getStreamCount() { return streams; };
+    uint16_t getStreamCrc() { return streamCrc; };
+    uint32_t getStreamLength() { return streamLength; };
+
+    // bytes fed, wait and starved microseconds, then start over
+    void takeThroughput(uint32_t out[3]) {
+      out[0] = fedBytes;
+      out[1] = waitTime;
+      out[2] = starvedTime;
+      fedBytes = waitTime = starvedTime = 0;
+    };
+#endif
+
+  private:
+    void begin();
+    void end();
+    void openTrack();
+    void selectTrack(int8_t sign = 1);
+    void readPresets(const __FlashStringHelper* fileName);
+    void started();
+    bool stopping();
 
-    uint8_t getTrack() {
+    uint8_t trackNumber() {
       uint8_t ret;
 
       if (next == UNKNOWN) {
@@ -54,7 +90,7 @@ class CDCClass : private VS1053
       return ret;
     };
 
-    uint8_t getDisc() {
+    uint8_t discNumber() {
       uint8_t ret;
 
       if (next == UNKNOWN) {
@@ -74,13 +110,41 @@ class CDCClass : private VS1053
       return ret;
     };
 
-    const String &getText(uint8_t id) { return audio.getTag(id); }
-
-  private:
-    void begin();
-    void end();
-    void openTrack();
-    void readPresets(const __FlashStringHelper* fileName);
+    // double-buffered position, written by the playback loop
+    struct {
+      uint8_t disc;
+      uint8_t track;
+      uint16_t time;
+    } volatile status[2];
+    volatile uint8_t seq;
+    void publish(bool now = false);
+
+    // commands from the CAN interrupt, applied by the playback loop
+    enum Command : uint8_t { SkipTrack, SkipTime, NextDisc, Preset, PowerOff };
+    struct {
+      Command cmd;
+      int8_t arg;
+    } volatile queue[QUEUE_SIZE];
+    volatile uint8_t head;
+    volatile uint8_t tail;
+    void post(Command cmd, int8_t arg = 0);
+    void update();
+
+    // SID text frames in send order, rendered by the playback loop,
+    // rows[0] spans both rows unless rows[1] holds a tag
+    uint8_t rows[2];
+    volatile uint8_t textFrames[6][8];
+    volatile uint8_t textVersion[2];
+    volatile bool textShown;
+    void render();
+
+    // text too long for its display positions followed by SCROLL_GAP spaces,
+    // scrolled by the CAN interrupt
+    volatile uint8_t scrollRing[MAX_TAG_LENGTH + SCROLL_GAP];
+    volatile uint8_t scrollLength;
+    volatile uint8_t scrollFirst;
+    volatile uint8_t scrollWidth;
+    uint8_t scrollOffset;
 
     uint16_t current;
     volatile uint16_t next;
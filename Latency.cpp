@@ -0,0 +1,91 @@
+/*
+ *  Latency keeps min, max, and mean times for the steps between a button and new audio
+ *   - A track changing command starts following the frame it came in
+ *   - Each step is counted the first time it's reached after the ones before it,
+ *     so the old track can't stand in for the new one
+ *   - Replies later than LATENCY_DEADLINE are counted as missed
+ *
+ */
+
+#include <util/atomic.h>
+#include "Latency.h"
+
+#ifdef LATENCYMODE
+
+LatencyClass Latency;
+
+// follow the frame being handled through the playback loop
+void LatencyClass::start() {
+  startedAt = receivedAt;
+  pending = _BV(Applied) | _BV(Opened) | _BV(Metadata) | _BV(Audio);
+}
+
+
+// note the first frame of the reply to the frame being handled,
+// ahead is how many queued frames go out before it
+void LatencyClass::replying(Point point, uint8_t ahead) {
+  if (replyPoint == NUM_POINTS && replyTo != receivedAt) {
+    replyPoint = point;
+    replyTo = receivedAt;
+    replyAhead = ahead;
+  }
+}
+
+
+// time the reply once the frames ahead of it and its first frame are sent
+// call when frames are requested to send
+void LatencyClass::sent(uint8_t frames) {
+  if (replyPoint == NUM_POINTS) {
+    return;
+  }
+
+  if (frames > replyAhead) {
+    add(replyPoint, micros() - replyTo);
+    replyPoint = NUM_POINTS;
+  } else {
+    replyAhead -= frames;
+  }
+}
+
+
+// count a step the first time it's reached after the ones before it
+void LatencyClass::mark(Point point) {
+  uint32_t now = micros();
+
+  ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+    if ((pending & _BV(point)) && !(pending & (_BV(point) - 1))) {
+      pending &= ~_BV(point);
+      add(point, now - startedAt);
+    }
+  }
+}
+
+
+// copy out count, missed, min, max, and mean, then start over
+void LatencyClass::take(uint8_t point, uint8_t out[16]) {
+  ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+    if (stats[point].count > 0) {
+      stats[point].sum /= stats[point].count;
+    }
+    memcpy(out, &stats[point], 16);
+    memset(&stats[point], 0, sizeof(stats[point]));
+  }
+}
+
+
+void LatencyClass::add(Point point, uint32_t elapsed) {
+  if (stats[point].count == 0 || elapsed < stats[point].min) {
+    stats[point].min = elapsed;
+  }
+  if (elapsed > stats[point].max) {
+    stats[point].max = elapsed;
+  }
+  if (elapsed > LATENCY_DEADLINE && point >= Control) {
+    stats[point].missed++;
+  }
+
+  stats[point].sum += elapsed;
+  stats[point].count++;
+}
+
+#endif // LATENCYMODE
@@ -0,0 +1,57 @@
+#ifndef LATENCY_H
+#define LATENCY_H
+
+#include <Arduino.h>
+
+//define LATENCYMODE
+
+#define LATENCY_DEADLINE  10000   // microseconds from request to reply before it counts as missed
+
+#ifdef LATENCYMODE
+
+// times from a track changing button to new audio, and from requests to replies
+//   - measured with micros() from the start of the interrupt that received the frame
+//   - a reply counts once, when its first frame is requested to send
+//   - kept in SRAM until taken, dumped through the SERIALMODE diagnostics
+class LatencyClass
+{
+  public:
+    enum Point : uint8_t { Applied, Opened, Metadata, Audio, Control, Power, NUM_POINTS };
+
+    // called from interrupt context
+    void received(uint32_t at) { receivedAt = at; };
+    void start();
+    void replying(Point point, uint8_t ahead);
+    void sent(uint8_t frames);
+
+    void mark(Point point);
+    void take(uint8_t point, uint8_t out[16]);
+
+  private:
+    void add(Point point, uint32_t elapsed);
+
+    struct {
+      uint16_t count;
+      uint16_t missed;
+      uint32_t min;
+      uint32_t max;
+      uint32_t sum;
+    } stats[NUM_POINTS];
+    static_assert(sizeof(stats[0]) == 16, "take copies 16 bytes");
+
+    // frame being handled and the command being followed to the codec
+    uint32_t receivedAt;
+    uint32_t startedAt;
+    volatile uint8_t pending;
+
+    // reply waiting to go out, NUM_POINTS if none, and the frames queued before it
+    Point replyPoint = NUM_POINTS;
+    uint32_t replyTo;
+    uint8_t replyAhead;
+};
+
+extern LatencyClass Latency;
+
+#endif // LATENCYMODE
+
+#endif // LATENCY_H
@@ -0,0 +1,24 @@
+/*
+ *  SPIBus keeps the SPI bus with one device across a batch of operations
+ *   - Transactions nest, only the outermost one reaches the SPI library
+ *   - Optionally adds up the bus time of each device
+ *
+ */
+
+#include "SPIBus.h"
+
+SPIBusClass SPIBus;
+
+#ifdef SPISTATSMODE
+
+void SPIBusClass::take(uint8_t out[NUM_SPI_TIMED * 6]) {
+  for (uint8_t i = 0; i < NUM_SPI_TIMED; i++) {
+    memcpy(out, &stats[i].time, 4);
+    memcpy(out + 4, &stats[i].count, 2);
+    out += 6;
+  }
+
+  memset(stats, 0, sizeof(stats));
+}
+
+#endif // SPISTATSMODE
@@ -0,0 +1,145 @@
+#ifndef SPIBUS_H
+#define SPIBUS_H
+
+#include <assert.h>
+#include <SPI.h>
+#include <util/atomic.h>
+#include <utility/Sd2PinMap.h>
+
+//define SPISTATSMODE
+
+// devices sharing the SPI bus, the card is timed around its block reads,
+// the stats are only read under SERIALMODE, where the CAN controller never runs,
+// so only the devices before SPI_CAN are timed
+enum SPIDevice : uint8_t { SPI_SCI, SPI_SDI, SPI_CARD, SPI_CAN, NUM_SPI_DEVICES };
+#define NUM_SPI_TIMED SPI_CAN
+
+// SPI transactions shared by back-to-back operations on one device
+//   - nested begin() calls join the transaction already open, so a batch of
+//     register accesses runs under one transaction with only chip select toggling
+//   - the interrupts named by SPI.usingInterrupt() stay off until the outermost end()
+//   - a transaction belongs to one device, another one nested inside would be
+//     clocked at the wrong settings, so that asserts
+//   - with SPISTATSMODE, the time each device holds the bus is added up
+class SPIBusClass
+{
+  public:
+    void begin(SPIDevice device, SPISettings settings) {
+      // depth only changes while interrupts that use the bus are held off
+      if (depth == 0) {
+        SPI.beginTransaction(settings);
+        owner = device;
+#ifdef SPISTATSMODE
+        startedAt = micros();
+#endif
+      }
+      assert(device == owner);
+      depth++;
+    };
+
+    void end(SPIDevice device) {
+      if (--depth == 0) {
+#ifdef SPISTATSMODE
+        // counted before the transaction lets interrupts back in
+        if (device < NUM_SPI_TIMED) {
+          add(device, micros() - startedAt);
+        }
+#endif
+        SPI.endTransaction();
+      }
+    };
+
+#ifdef SPISTATSMODE
+    // count bus time not covered by a transaction here
+    void add(SPIDevice device, uint32_t elapsed) {
+      stats[device].time += elapsed;
+      stats[device].count++;
+    };
+
+    // interrupt time to leave out of what add() is given
+    // call from the interrupt handler
+    void interrupted(uint16_t elapsed) { isrTime += elapsed; };
+    uint32_t interruptTime() {
+      uint32_t t;
+      ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+        t = isrTime;
+      }
+      return t;
+    };
+
+    // bus microseconds and transactions per timed device, then start over
+    // call from interrupt context
+    void take(uint8_t out[NUM_SPI_TIMED * 6]);
+#endif
+
+  private:
+    uint8_t depth;
+    SPIDevice owner;
+
+#ifdef SPISTATSMODE
+    uint32_t startedAt;
+    uint32_t isrTime;
+    struct {
+      uint32_t time;
+      uint16_t count;
+    } stats[NUM_SPI_TIMED];
+#endif
+};
+
+extern SPIBusClass SPIBus;
+
+
+// a chip on the shared bus, everything about it fixed at compile time
+//   - chip select is a single sbi/cbi on the pin's port
+//   - burst transfers load the next byte while the current one shifts out
+template<uint8_t CsPin, uint32_t Clock, uint8_t Mode, SPIDevice Id>
+class SPIChip
+{
+  public:
+    static void setup() {
+      pinMode(CsPin, OUTPUT);
+      fastDigitalWrite(CsPin, HIGH);
+    };
+
+    // nested begin() calls share one transaction
+    static void begin() { SPIBus.begin(Id, SPISettings(Clock, MSBFIRST, Mode)); };
+    static void end() { SPIBus.end(Id); };
+
+    static void select() { fastDigitalWrite(CsPin, LOW); };
+    static void deselect() { fastDigitalWrite(CsPin, HIGH); };
+
+    static uint8_t read() { return SPI.transfer(0x00); };
+    static void write(uint8_t c) { SPI.transfer(c); };
+
+    static void read(uint8_t data[], uint8_t length) {
+      if (length == 0) {
+        return;
+      }
+
+      SPDR = 0x00;
+      while (--length) {
+        while (bit_is_clear(SPSR, SPIF));
+        uint8_t c = SPDR;
+        SPDR = 0x00;
+        *data++ = c;
+      }
+      while (bit_is_clear(SPSR, SPIF));
+      *data = SPDR;
+    };
+
+    static void write(const uint8_t data[], uint8_t length) {
+      if (length == 0) {
+        return;
+      }
+
+      SPDR = *data++;
+      while (--length) {
+        uint8_t c = *data++;
+        while (bit_is_clear(SPSR, SPIF));
+        SPDR = c;
+      }
+      while (bit_is_clear(SPSR, SPIF));
+    };
+};
+
+#endif // SPIBUS_H
@@ -0,0 +1,247 @@
+/*
+ *  Trace keeps a record of the I-Bus traffic on the SD card
+ *   - Frames are stored in 512 byte blocks of a preallocated, contiguous file
+ *   - The file is used as a ring, the newest block has the highest sequence number
+ *   - Received frames can be replayed into the interrupt handler
+ *
+ */
+
+#include <SD.h>
+#include <util/atomic.h>
+#include "Trace.h"
+
+#ifdef TRACEMODE
+
+TraceClass Trace;
+
+// the card behind the SD library, for raw block access
+static Sd2Card *card() {
+  SdVolume volume;
+  return volume.sdCard();
+}
+
+
+// find the trace file and continue after its newest block
+// call from the playback loop once the card is open
+void TraceClass::begin() {
+  // the block buffer is needed for the search
+  full = true;
+
+  File file = SD.open(F(TRACE_FILE));
+  active = file && file.contiguousRange(&first, &last);
+  file.close();
+
+  seq = 1;
+  current = first;
+
+  // sequence numbers increase from the first block up to the newest one,
+  // older and unwritten blocks after it have lower numbers
+  if (active && read(first) && block.seq != 0) {
+    uint32_t base = block.seq;
+    uint32_t newest = base;
+    uint32_t lo = first;
+    uint32_t hi = last;
+
+    while (active && lo < hi) {
+      uint32_t mid = hi - (hi - lo) / 2;
+      active = read(mid);
+      if (block.seq >= base) {
+        lo = mid;
+        newest = block.seq;
+      } else {
+        hi = mid - 1;
+      }
+    }
+
+    seq = newest + 1;
+    current = (lo == last) ? first : lo + 1;
+  }
+
+  reset();
+}
+
+
+// write what has been recorded and stop
+void TraceClass::end() {
+  if (active && !replaying && block.count > 0) {
+    full = true;
+    write();
+  }
+
+  active = false;
+  wanted = false;
+  replaying = false;
+  ready = false;
+}
+
+
+// write a full block, or keep a replay going
+// call from the playback loop, card is true if the card may be used now
+void TraceClass::update(bool card) {
+  if (!active) {
+    return;
+  }
+
+  // switch between recording and replaying
+  if (wanted != replaying) {
+    if (wanted) {
+      // keep what has been recorded so far, then play from the oldest block
+      if (!card) {
+        return;
+      }
+      replaying = true;
+      if (block.count > 0) {
+        write();
+      }
+      replayBlock = current;
+      replayLeft = last - first + 1;
+      lastTime = 0xffffffff;
+      ready = false;
+    } else {
+      replaying = false;
+      ready = false;
+      reset();
+    }
+  }
+
+  if (replaying) {
+    // fetch the next block once this one has been played
+    if (!ready) {
+      if (!card) {
+        return;
+      }
+      if (replayLeft == 0 || !read(replayBlock)) {
+        wanted = false;
+        return;
+      }
+      if (block.seq == 0) {
+        block.count = 0;
+      }
+      replayBlock = (replayBlock == last) ? first : replayBlock + 1;
+      replayLeft--;
+
+      index = 0;
+      ready = true;
+    }
+
+    // hand frames that are due to the interrupt handler
+    ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+      if (due()) {
+        handler();
+      }
+    }
+  } else if (full && card) {
+    write();
+  }
+}
+
+
+// add a frame to the block being filled, counted as lost while it's full
+void TraceClass::record(const CANClass::msg &msg, bool tx) {
+  if (replaying) {
+    return;
+  }
+
+  if (full) {
+    if (lost < 0xff) lost++;
+    return;
+  }
+
+  Record &r = block.records[block.count];
+  r.time = millis();
+  r.id = msg.id;
+  r.flags = msg.header.length;
+  if (msg.header.rtr) r.flags |= TRACE_RTR;
+  if (tx) r.flags |= TRACE_TX;
+  memcpy(r.data, msg.data, sizeof(r.data));
+
+  if (++block.count == TRACE_RECORDS) {
+    full = true;
+  }
+}
+
+
+// start or stop replaying the trace through handler
+void TraceClass::replay(void (*handler)()) {
+  this->handler = handler;
+  wanted = !wanted;
+}
+
+
+// take the replayed frame that is due
+// returns true if there was one
+bool TraceClass::next(CANClass::msg &msg) {
+  const Record *r = due();
+  if (!r) {
+    return false;
+  }
+
+  lastTime = r->time;
+  lastAt = millis();
+
+  msg.id = r->id;
+  msg.header.rtr = r->flags & TRACE_RTR;
+  msg.header.length = r->flags & TRACE_LENGTH;
+  memcpy(msg.data, r->data, sizeof(msg.data));
+  index++;
+
+  return true;
+}
+
+
+// the next received frame of the replay block once its time has come
+const TraceClass::Record *TraceClass::due() {
+  while (ready) {
+    if (index >= block.count) {
+      ready = false;
+      break;
+    }
+
+    // our own replies aren't replayed
+    const Record *r = &block.records[index];
+    if (r->flags & TRACE_TX) {
+      index++;
+      continue;
+    }
+
+    // keep the spacing to the previous frame, time restarts with each power-up
+    if (r->time > lastTime && millis() - lastAt < r->time - lastTime) {
+      break;
+    }
+
+    return r;
+  }
+
+  return NULL;
+}
+
+
+// start filling a new block
+void TraceClass::reset() {
+  ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+    memset(&block, 0, sizeof(block) - sizeof(block.records));
+    block.seq = seq;
+    block.dropped = lost;
+    lost = 0;
+    full = false;
+  }
+}
+
+
+// write the full block to the card and move on to the next one
+bool TraceClass::write() {
+  active = card()->writeBlock(current, (const uint8_t *) &block);
+
+  current = (current == last) ? first : current + 1;
+  seq++;
+  reset();
+
+  return active;
+}
+
+
+bool TraceClass::read(uint32_t number) {
+  return card()->readBlock(number, (uint8_t *) &block);
+}
+
+#endif // TRACEMODE
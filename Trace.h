@@ -0,0 +1,89 @@
+#ifndef TRACE_H
+#define TRACE_H
+
+#include <SD.h>
+#include "CAN.h"
+
+//define TRACEMODE
+
+#define TRACE_FILE     "TRACE.BIN"  // preallocated contiguous file, e.g. a few MB of zeros
+#define TRACE_RECORDS  31           // frames per block after the header
+#define TRACE_TX       0x80         // record flags
+#define TRACE_RTR      0x40
+#define TRACE_LENGTH   0x0f
+#define TRACE_CARD_MS  10           // audio the codec must hold before the card is read or written
+
+#ifdef TRACEMODE
+
+// records CAN frames into whole blocks of a preallocated file, as a ring,
+// and plays received frames back with their original spacing
+//   - blocks are written by the playback loop straight to the card from their own
+//     buffer, the SD cache and what it holds are left alone
+//   - a card access can take milliseconds, the playback loop only allows it while
+//     the codec holds enough audio to cover it
+//   - needs 512 bytes of RAM, lower MAX_TAG_LENGTH to make room
+class TraceClass
+{
+  public:
+    void begin();
+    void end();
+    void update(bool card);
+    bool needsCard() { return active && (wanted != replaying || (replaying ? !ready : full)); };
+
+    // called from interrupt context
+    void record(const CANClass::msg &msg, bool tx);
+    void replay(void (*handler)());
+    bool isReplaying() { return replaying; };
+    bool next(CANClass::msg &msg);
+
+  private:
+    void reset();
+    bool read(uint32_t number);
+    bool write();
+
+    typedef struct {
+      uint32_t time;
+      uint16_t id;
+      uint8_t flags;
+      uint8_t reserved;
+      uint8_t data[8];
+    } Record;
+
+    // one card block, filled by the CAN interrupt and written by the playback loop
+    struct {
+      uint32_t seq;          // increases block by block, 0 if never written
+      uint8_t count;
+      uint8_t dropped;       // frames lost before this block
+      uint8_t reserved[10];
+      Record records[TRACE_RECORDS];
+    } block;
+    static_assert(sizeof(block) == 512, "trace block must fill a card block");
+
+    // trace file blocks and the next one to write
+    bool active;
+    uint32_t first;
+    uint32_t last;
+    uint32_t current;
+    uint32_t seq;
+
+    volatile bool full;
+    volatile uint8_t lost;
+
+    // playback, started and stopped from interrupt context
+    void (*handler)();
+    volatile bool wanted;
+    volatile bool replaying;
+    volatile bool ready;
+    volatile uint8_t index;
+    uint32_t replayBlock;
+    uint32_t replayLeft;
+    uint32_t lastTime;
+    uint32_t lastAt;
+    const Record *due();
+};
+
+extern TraceClass Trace;
+
+#endif // TRACEMODE
+
+#endif // TRACE_H
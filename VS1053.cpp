@@ -6,10 +6,14 @@
 
 #include <SPI.h>
 #include <SD.h>
+#include <util/atomic.h>
+#include <util/crc16.h>
 #include "VS1053.h"
+#include "Latency.h"
+#include "SPIBus.h"
 
-#define VS1053_SCI_SETTING SPISettings(12288000/7, MSBFIRST, SPI_MODE0)
-#define VS1053_SDI_SETTING SPISettings(55296000/4, MSBFIRST, SPI_MODE0)
+typedef SPIChip<VS1053_XCS, 12288000/7, SPI_MODE0, SPI_SCI> SCI;
+typedef SPIChip<VS1053_XDCS, 55296000/4, SPI_MODE0, SPI_SDI> SDI;
 
 // setup pins
 void VS1053::setup() {
@@ -18,13 +22,9 @@ void VS1053::setup() {
   digitalWrite(VS1053_XRESET, LOW);
   state = Off;
 
-  // configure control pin
-  pinMode(VS1053_XCS, OUTPUT);
-  digitalWrite(VS1053_XCS, HIGH);
-
-  // configure data pin
-  pinMode(VS1053_XDCS, OUTPUT);
-  digitalWrite(VS1053_XDCS, HIGH);
+  // configure control and data pins
+  SCI::setup();
+  SDI::setup();
 
   // configure interrupt pin
   pinMode(VS1053_XDREQ, INPUT);
@@ -79,6 +79,15 @@ void VS1053::playTrack() {
     return;
   }
 
+#ifdef STREAMMODE
+  sdiCrc = 0xffff;
+  sdiLength = 0;
+
+  // the codec starts out empty
+  level = 0;
+  levelAt = micros();
+#endif
+
   // wait up to 15ms for HDAT to clear
   for (uint8_t j = 15; j > 0 && sciRead(SCI_HDAT1); j--) {
     delay(1);
@@ -91,23 +100,50 @@ void VS1053::playTrack() {
 
   // process metadata
   do {
+    if (stopping()) {
+      audio.close();
+      break;
+    }
     bytesRead = audio.readMetadata(buffer);
     sendData(buffer, bytesRead);
   } while (bytesRead > 0);
+  started();
+
+  // closing the track forgets its type, so size the end fill now
+  uint16_t fill = audio.isHighBitRate() ? 384 : 64;
 
   // turn analog up
   setVolume(0x00, 0x00);
 
-  // send data until the track is closed
+  // send data until the track is closed, commands can now change the track
+  streaming = true;
   while (audio) {
+    update();
+    if (!audio) {
+      // closed by a command
+      break;
+    }
     bytesRead = audio.readBlock(buffer);
 
     if (bytesRead > 0) {
       sendData(buffer, bytesRead);
+#ifdef LATENCYMODE
+      Latency.mark(LatencyClass::Audio);
+#endif
     } else {
       audio.close();
     }
   }
+  streaming = false;
+
+#ifdef STREAMMODE
+  // the fill and cancel below run as long as the codec takes, so they're left out
+  ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+    streamCrc = sdiCrc;
+    streamLength = sdiLength;
+    streams++;
+  }
+#endif
 
   // get codec specific filler
   sciWrite(SCI_WRAMADDR, XP_ENDFILLBYTE);
@@ -115,7 +151,7 @@ void VS1053::playTrack() {
   buffer = audio.fillBuffer(endFillByte, VS1053_BUFFER_SIZE);
 
   // flush buffer
-  uint16_t i = audio.isHighBitRate() ? 384 : 64;
+  uint16_t i = fill;
   do {
     sendData(buffer, VS1053_BUFFER_SIZE);
   } while (--i != 0);
@@ -124,7 +160,7 @@ void VS1053::playTrack() {
   sciWrite(SCI_MODE, SM_SDINEW | SM_CANCEL);
 
   // send endFillByte until cancel is accepted
-  i = audio.isHighBitRate() ? 384 : 64;
+  i = fill;
   do {
     sendData(buffer, VS1053_BUFFER_SIZE);
   } while ((--i != 0) && (sciRead(SCI_MODE) & SM_CANCEL));
@@ -149,6 +185,26 @@ void VS1053::skip(int16_t secs) {
 }
 
 
+// milliseconds of audio the codec is sure to hold, 0 if it could be running low
+// only while the playback loop waits for DREQ is there any to spare
+uint16_t VS1053::spareTime() {
+  if (!audio || state == Paused) {
+    // nothing to run out of
+    return 0xffff;
+  }
+
+  if (readyForData()) {
+    return 0;
+  }
+
+  // a full buffer at the average byterate
+  sciWrite(SCI_WRAMADDR, XP_BYTERATE);
+  uint32_t rate = audio.byteRate(sciRead(SCI_WRAM));
+
+  return rate ? (uint32_t)(VS1053_FIFO_SIZE - VS1053_BUFFER_SIZE) * 1000 / rate : 0;
+}
+
+
 // get approximate track position in seconds
 uint16_t VS1053::trackTime() {
   uint16_t ret;
@@ -164,11 +220,13 @@ uint16_t VS1053::trackTime() {
 
 
 // load a patch or plugin from disk
+// returns false if there isn't one
 bool VS1053::loadPlugin(const __FlashStringHelper* fileName) {
   uint8_t buff[2];
   uint16_t addr, count, val;
 
   File plugin = SD.open(fileName);
+  bool found = plugin;
   while (plugin.available()) {
     plugin.read(buff, 2);
     addr = buff[0];
@@ -195,28 +253,84 @@ bool VS1053::loadPlugin(const __FlashStringHelper* fileName) {
   }
 
   plugin.close();
+  return found;
 }
 
 
 // send data to the codec
 void VS1053::sendData(uint8_t data[], uint16_t len) {
+#ifdef STREAMMODE
+  // drain what the codec was estimated to hold since the last send
+  uint32_t starved = 0;
+  if (readyForData()) {
+    uint32_t now = micros();
+    sciWrite(SCI_WRAMADDR, XP_BYTERATE);
+    uint32_t rate = audio.byteRate(sciRead(SCI_WRAM));
+
+    if (rate) {
+      // microseconds the level lasts at the average byterate
+      uint32_t lasts = (uint32_t)level * 1000000 / rate;
+      uint32_t elapsed = now - levelAt;
+      if (elapsed > lasts) {
+        starved = elapsed - lasts;
+        level = 0;
+      } else {
+        level -= elapsed * rate / 1000000;
+      }
+    }
+  } else {
+    // no room for another chunk, so the codec is as good as full
+    level = VS1053_FIFO_SIZE - VS1053_BUFFER_SIZE;
+  }
+  uint32_t waited = 0;
+  uint16_t bytes = len;
+#endif
+
   while (len > 0) {
-    while (!readyForData() || state == Paused);
+#ifdef STREAMMODE
+    uint32_t start = micros();
+#endif
+    while (!readyForData() || state == Paused) {
+      // metadata and the end fill only look out for power off
+      if (streaming) {
+        update();
+      } else {
+        stopping();
+      }
+    }
+#ifdef STREAMMODE
+    waited += micros() - start;
+#endif
 
-    SPI.beginTransaction(VS1053_SDI_SETTING);
-    fastDigitalWrite(VS1053_XDCS, LOW);
+    SDI::begin();
+    SDI::select();
 
     while (len > 0 && readyForData()) {
       uint8_t chunk = min(VS1053_BUFFER_SIZE, len);
+#ifdef STREAMMODE
       for (uint8_t i = 0; i < chunk; i++) {
-        spiwrite(*data++);
+        sdiCrc = _crc_ccitt_update(sdiCrc, data[i]);
       }
+      sdiLength += chunk;
+#endif
+      SDI::write(data, chunk);
+      data += chunk;
       len -= chunk;
     }
 
-    fastDigitalWrite(VS1053_XDCS, HIGH);
-    SPI.endTransaction();
+    SDI::deselect();
+    SDI::end();
   }
+
+#ifdef STREAMMODE
+  level = min(level + bytes, VS1053_FIFO_SIZE);
+  levelAt = micros();
+  ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+    fedBytes += bytes;
+    waitTime += waited;
+    starvedTime += starved;
+  }
+#endif
 }
 
 
@@ -234,34 +348,34 @@ void VS1053::setVolume(uint8_t left, uint8_t right) {
 uint16_t VS1053::sciRead(uint8_t addr) {
   uint16_t data;
 
-  SPI.beginTransaction(VS1053_SCI_SETTING);
-  fastDigitalWrite(VS1053_XCS, LOW);
+  SCI::begin();
+  SCI::select();
 
-  spiwrite(VS_READ_COMMAND);
-  spiwrite(addr);
+  SCI::write(VS_READ_COMMAND);
+  SCI::write(addr);
   delayMicroseconds(10);
-  data = spiread();
+  data = SCI::read();
   data <<= 8;
-  data |= spiread();
+  data |= SCI::read();
 
-  fastDigitalWrite(VS1053_XCS, HIGH);
-  SPI.endTransaction();
+  SCI::deselect();
+  SCI::end();
 
   return data;
 }
 
 
 void VS1053::sciWrite(uint8_t addr, uint16_t data) {
-  SPI.beginTransaction(VS1053_SCI_SETTING);
-  fastDigitalWrite(VS1053_XCS, LOW);
+  SCI::begin();
+  SCI::select();
 
-  spiwrite(VS_WRITE_COMMAND);
-  spiwrite(addr);
-  spiwrite(data >> 8);
-  spiwrite(data);
+  SCI::write(VS_WRITE_COMMAND);
+  SCI::write(addr);
+  SCI::write(data >> 8);
+  SCI::write(data);
 
-  fastDigitalWrite(VS1053_XCS, HIGH);
-  SPI.endTransaction();
+  SCI::deselect();
+  SCI::end();
 }
 
 
@@ -270,13 +384,3 @@ inline __attribute__((always_inline))
 bool VS1053::readyForData() {
   return fastDigitalRead(VS1053_XDREQ);
 }
-
-inline __attribute__((always_inline))
-uint8_t VS1053::spiread() {
-  return SPI.transfer(0x00);
-}
-
-inline __attribute__((always_inline))
-void VS1053::spiwrite(uint8_t c) {
-  SPI.transfer(c);
-}
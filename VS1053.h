@@ -4,6 +4,9 @@
 #include "AudioFile.h"
 
 #define VS1053_BUFFER_SIZE   32
+#define VS1053_FIFO_SIZE     2048 // SDI buffer, DREQ drops when less than VS1053_BUFFER_SIZE of it is free
+
+//define STREAMMODE           // checksum and time what the codec is fed
 
 #define VS1053_XRESET        9    // VS1053 Reset pin (output)
 #define VS1053_XCS           7    // VS1053 SPI Control select pin (output)
@@ -83,20 +86,55 @@ class VS1053 {
   protected:
     void setVolume(uint8_t left, uint8_t right);
     bool loadPlugin(const __FlashStringHelper* fileName);
+    uint16_t spareTime();
 
     volatile State state;
     AudioFile audio;
 
+    // called by the playback loop between audio blocks, where it's safe to use
+    // the codec and change tracks, must not load anything into the SD cache
+    virtual void update() {}
+
+    // called by the playback loop once the metadata of a track has been read
+    virtual void started() {}
+
+    // called by the playback loop while it sends metadata or the end fill,
+    // where update() can't be, true gives up on the track
+    virtual bool stopping() { return false; }
+
+#ifdef STREAMMODE
+    // CRC and length of the SDI bytes of the last track up to the end fill,
+    // streams counts the tracks
+    volatile uint8_t streams;
+    volatile uint16_t streamCrc;
+    volatile uint32_t streamLength;
+
+    // bytes fed since last taken, microseconds spent waiting for the codec
+    // and estimated for the codec running out of data
+    volatile uint32_t fedBytes;
+    volatile uint32_t waitTime;
+    volatile uint32_t starvedTime;
+#endif
+
   private:
     bool readyForData();
     void sendData(uint8_t data[], uint16_t len);
 
     uint16_t sciRead(uint8_t addr);
     void sciWrite(uint8_t addr, uint16_t data);
-    void spiwrite(uint8_t c);
-    uint8_t spiread();
 
     int16_t skippedTime;
+    bool streaming;
+
+#ifdef STREAMMODE
+    uint16_t sdiCrc;
+    uint32_t sdiLength;
+
+    // bytes the codec is estimated to hold as of a time, full whenever DREQ
+    // is seen low and drained at the average byterate between sends
+    uint16_t level;
+    uint32_t levelAt;
+#endif
 };
 
 #endif // VS1053_H
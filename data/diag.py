@@ -0,0 +1,122 @@
+#!/usr/bin/env python3
+"""
+Decoder and injector for the iSaab SERIALMODE diagnostics, see iSaab.h
+
+  diag.py PORT                 print what the module sends
+  diag.py PORT SCRIPT          also inject the frames in SCRIPT
+  diag.py PORT -c w            send a command, w for counters, m for memory, l for latency, p for playback, s for SPI, y for trace replay
+
+Each SCRIPT line is a delay in milliseconds, an id and up to 8 data bytes in hex:
+  0    6a1 00 00 00 03           # power on
+  500  3c0 00 35                 # next track
+  100  368 00 12                 # SID text request
+'#' starts a comment, 'r' after the id sends a remote frame. Requires pyserial.
+"""
+
+import struct
+import sys
+import threading
+import time
+
+import serial
+
+BAUD = 1000000
+SYNC = 0xa5
+RX, TX, STATUS, COUNTERS, COMMAND, LATENCY, MEMORY, STREAM, PLAYBACK, SPI = range(1, 11)
+POINTS = ['applied', 'opened', 'metadata', 'audio', 'control reply', 'power reply']
+DEVICES = ['SCI', 'SDI', 'card']
+STATES = {0x00: 'Off', 0x30: 'Busy', 0x40: 'Paused', 0x41: 'Playing', 0x60: 'Rapid'}
+
+
+def frame(kind, payload):
+    check = kind ^ len(payload)
+    for b in payload:
+        check ^= b
+    return bytes([SYNC, kind, len(payload)]) + payload + bytes([check])
+
+
+def inject(port, script):
+    for line in open(script):
+        words = line.split('#')[0].split()
+        if len(words) < 2:
+            continue
+        time.sleep(int(words[0]) / 1000)
+        rtr = len(words) > 2 and words[2] == 'r'
+        data = bytes(int(w, 16) for w in words[3 if rtr else 2:])
+        flags = len(data) | (0x40 if rtr else 0)
+        port.write(frame(RX, struct.pack('<HB', int(words[1], 16), flags) + data.ljust(8, b'\0')))
+
+
+def show(kind, payload):
+    stamp = '%10.3f' % time.monotonic()
+    if kind == TX and len(payload) == 11:
+        ident, flags = struct.unpack_from('<HB', payload)
+        data = ' '.join('%02x' % b for b in payload[3:3 + (flags & 0x0f)])
+        print(stamp, 'TX %03x%s %s' % (ident, ' r' if flags & 0x40 else '', data))
+    elif kind == STATUS and len(payload) == 6:
+        state, shuffled, disc, track, seconds = struct.unpack('<BBBBH', payload)
+        name = STATES.get(state, '%02x' % state)
+        print(stamp, 'STATUS %s%s disc %d track %d time %d:%02d'
+              % (name, ' shuffled' if shuffled else '', disc, track, seconds // 60, seconds % 60))
+    elif kind == COUNTERS and len(payload) == 14:
+        worst, sent, saved, ms = struct.unpack('<HIII', payload)
+        minutes = max(ms, 1) / 60000
+        print(stamp, 'COUNTERS isr %d us, bus %d/%d bytes per minute'
+              % (worst, sent / 8 / minutes, (sent + saved) / 8 / minutes))
+    elif kind == LATENCY and len(payload) == 17:
+        point, count, missed, low, high, mean = struct.unpack('<BHHIII', payload)
+        name = POINTS[point] if point < len(POINTS) else point
+        print(stamp, 'LATENCY %-13s %5d times, min %d max %d mean %d us, %d missed'
+              % (name, count, low, high, mean, missed))
+    elif kind == MEMORY and len(payload) == 8:
+        print(stamp, 'MEMORY static %d, heap %d, stack %d, free %d bytes' % struct.unpack('<HHHH', payload))
+    elif kind == STREAM and len(payload) == 7:
+        print(stamp, 'STREAM %d: %d bytes, crc %04x' % struct.unpack('<BIH', payload))
+    elif kind == PLAYBACK and len(payload) == 16:
+        fed, waited, starved, ms = struct.unpack('<IIII', payload)
+        ms = max(ms, 1)
+        print(stamp, 'PLAYBACK %d bytes/s, waiting for codec %.1f%%, codec starved %.1f%% (estimated)'
+              % (fed * 1000 / ms, waited / ms / 10, starved / ms / 10))
+    elif kind == SPI and len(payload) == 6 * len(DEVICES) + 4:
+        ms = max(struct.unpack_from('<I', payload, 6 * len(DEVICES))[0], 1)
+        for i, name in enumerate(DEVICES):
+            busy, count = struct.unpack_from('<IH', payload, 6 * i)
+            print(stamp, 'SPI %-4s %5.1f%% busy, %d transactions' % (name, busy / ms / 10, count))
+    else:
+        print(stamp, 'type %02x: %s' % (kind, payload.hex()))
+
+
+def decode(port):
+    while True:
+        if port.read(1) != bytes([SYNC]):
+            continue
+        head = port.read(2)
+        if len(head) < 2:
+            continue
+        kind, length = head
+        rest = port.read(length + 1)
+        check = kind ^ length
+        for b in rest:
+            check ^= b
+        if len(rest) == length + 1 and check == 0:
+            show(kind, rest[:-1])
+
+
+def main():
+    if len(sys.argv) < 2:
+        sys.exit(__doc__)
+
+    port = serial.Serial(sys.argv[1], BAUD, timeout=1)
+    if len(sys.argv) > 3 and sys.argv[2] == '-c':
+        port.write(frame(COMMAND, sys.argv[3][:1].encode()))
+    elif len(sys.argv) > 2:
+        threading.Thread(target=inject, args=(port, sys.argv[2]), daemon=True).start()
+
+    try:
+        decode(port)
+    except KeyboardInterrupt:
+        pass
+
+
+if __name__ == '__main__':
+    main()
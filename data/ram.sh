@@ -0,0 +1,5 @@
+#!/bin/sh
+# static RAM (.data + .bss) per object file, largest first, then the total
+#   arduino-cli compile -b arduino:avr:uno --build-path build && data/ram.sh build
+find "${1:-build}" -name '*.o' -exec avr-size -B {} \; | awk '$1 != "text" { printf "%6d  %s\n", $2 + $3, $6 }' | sort -rn |
+  awk '{ total += $1; print } END { printf "%6d  total of 2048\n", total }'
@@ -31,10 +31,43 @@
 #define TX_SID_TEXT              0x337
 
 
+// SID polls between steps of scrolling text, bounds the text traffic
+#define SCROLL_POLLS             3
+
+// bits in a standard frame with length data bytes, before bit stuffing
+#define FRAME_BITS(length)       (47 + 8 * (length))
+
+
+// I-Bus @ 47.619Kbps, same as the old CNF 0xc7/0xbe/0x04
+// https://forum.microchip.com/s/topic/a5C3l000000Lyo8EAC/t225476
+typedef CANTiming<MCP2515_OSC, 47619> IBusTiming;
+
+// controller resets tried at boot before the module gives up on the I-Bus
+#define CAN_BEGIN_TRIES          10
+
 // only accept these messages
 const uint16_t high_filters[] PROGMEM = {RX_CDC_POWER, RX_CDC_CONTROL, 0x7ff};
 const uint16_t low_filters[] PROGMEM = {RX_SID_REQUEST, 0x000, 0x000, 0x000, 0x7ff};
 
 //define SERIALMODE
 
+// SERIALMODE diagnostics, data/diag.py decodes and injects them
+//   sync, type, length, payload, xor of type through payload
+//   multi-byte fields are little-endian
+#define DIAG_BAUD                1000000
+#define DIAG_POLL_HZ             1000    // serial reads, above the I-Bus frame rate
+#define DIAG_SYNC                0xa5
+#define DIAG_PAYLOAD             14      // longest payload to the module
+#define DIAG_RX                  0x01    // to module, frame to act on: id, rtr << 6 | length, data[8]
+#define DIAG_TX                  0x02    // from module, frame sent: as DIAG_RX
+#define DIAG_STATUS              0x03    // from module, on change: state, shuffled, disc, track, time
+#define DIAG_COUNTERS            0x04    // from module: isr worst us, bus bits sent, saved, ms since last
+#define DIAG_COMMAND             0x05    // to module: 'w' counters, 'm' memory, 'l' latency, 'p' playback, 's' SPI, 'y' trace replay
+#define DIAG_LATENCY             0x06    // from module, one per LatencyClass::Point: point, count, missed, min, max, mean us
+#define DIAG_MEMORY              0x07    // from module: static, most heap, most stack, least free bytes
+#define DIAG_STREAM              0x08    // from module, after each track with STREAMMODE: count, codec bytes, CRC
+#define DIAG_PLAYBACK            0x09    // from module with STREAMMODE: bytes fed, wait us, starved us, ms since last
+#define DIAG_SPI                 0x0a    // from module with SPISTATSMODE: bus us and transactions for SCI, SDI and card, ms since last
+#define STACK_PAINT              0xc5    // free RAM fill
+
 #endif // iSaab_H
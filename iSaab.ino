@@ -8,23 +8,56 @@
 #include <avr/sleep.h>
 #include "CAN.h"
 #include "CDC.h"
+#include "Latency.h"
+#include "SPIBus.h"
+#include "Trace.h"
 #include "iSaab.h"
 
-uint8_t tag = AudioFile::NUM_TAGS;
 bool newText;
 
+// longest time spent in processMessage, in microseconds
+uint16_t isrWorst;
+
+// version of the text rows last sent to the SID
+uint8_t textSent[2];
+
+// bits sent on the I-Bus and text frames left out since busSince
+uint32_t busSent;
+uint32_t busSaved;
+uint32_t busSince;
+
+#ifdef SERIALMODE
+// free RAM lies between the heap and the stack, painted at boot
+extern uint8_t __heap_start;
+
+// paint below the stack before static data is set up, what neither the
+// heap nor the stack has reached since is then the longest painted run
+void paintStack() __attribute__((naked, used, section(".init3")));
+void paintStack() {
+  for (uint8_t *p = &__heap_start; p < (uint8_t *) SP; p++) {
+    *p = STACK_PAINT;
+  }
+}
+#endif
+
 // one-time setup
 void setup() {
   // setup sound card
   CDC.setup();
 
 #ifndef SERIALMODE
-  // open I-Bus @ 47.619Kbps
-  CAN.begin(47, high_filters, low_filters);
+  // open I-Bus @ 47.619Kbps, resetting the controller a few times if it doesn't take
+  uint8_t tries = CAN_BEGIN_TRIES;
+  while (!CAN.begin<IBusTiming>(high_filters, low_filters) && --tries > 0) {
+    delay(100);
+  }
 
-  // use IRQ for incoming messages
-  SPI.usingInterrupt(MCP2515_INT);
-  attachInterrupt(MCP2515_INT, processMessage, LOW);
+  // use IRQ for incoming messages, a controller that never came up
+  // could hold it low, so then nothing wakes the module until it's reset
+  if (tries > 0) {
+    SPI.usingInterrupt(MCP2515_INT);
+    attachInterrupt(MCP2515_INT, processMessage, LOW);
+  }
 
   // reduce power
   set_sleep_mode(SLEEP_MODE_PWR_DOWN);
@@ -32,13 +65,13 @@ void setup() {
   power_timer1_disable();
 #else
   // open serial
-  Serial.begin(115200);
+  Serial.begin(DIAG_BAUD);
 
   // use timer to read serial
   SPI.usingInterrupt(255);
   TCCR1A = 0;
-  TCCR1B = _BV(WGM12) | _BV(CS12);
-  OCR1A  = F_CPU / 256 / 2 - 1;
+  TCCR1B = _BV(WGM12) | _BV(CS11) | _BV(CS10);
+  OCR1A  = F_CPU / 64 / DIAG_POLL_HZ - 1;
   TIMSK1 |= _BV(OCIE1A);
 
   // reduce power
@@ -61,15 +94,25 @@ void loop() {
 // interrupt handler for incoming message
 void processMessage() {
   static uint8_t gap = 0;
+  uint32_t start = micros();
 
+#ifndef SERIALMODE
   // starting to receive CDC messages, wake up
   if (gap == 0) {
     CAN.setMode(CANClass::Normal);
   }
+#endif
 
   // act on message
   CANClass::msg msg;
   if (receiveMessage(msg)) {
+#ifdef TRACEMODE
+    Trace.record(msg, false);
+#endif
+#ifdef LATENCYMODE
+    Latency.received(start);
+#endif
+
     switch (msg.id) {
       case RX_CDC_CONTROL:
         controlRequest(msg);
@@ -88,10 +131,29 @@ void processMessage() {
     }
   }
 
+#ifndef SERIALMODE
+  // send queued replies
+  CAN.flush();
+
   // no more CDC messages, go to sleep
   if (gap == 0) {
     CAN.setMode(CANClass::ListenOnly);
   }
+#else
+  diagStatus();
+#ifdef STREAMMODE
+  diagStream();
+#endif
+#endif
+
+  // track worst case duration
+  uint16_t elapsed = micros() - start;
+  if (elapsed > isrWorst) {
+    isrWorst = elapsed;
+  }
+#ifdef SPISTATSMODE
+  SPIBus.interrupted(elapsed);
+#endif
 }
 
 
@@ -174,27 +236,14 @@ void controlRequest(CANClass::msg &msg) {
     case 0x46: // PLAY <<
       CDC.skipTime(-repeatCount);
       break;
-    case 0x59: // NXT
+    case 0x59: // NXT, rotates the display tag when shuffled
       if (repeatCount == 1) {
-        if (CDC.isShuffled()) {
-          // rotate display tag
-          tag = (tag + 1) % (AudioFile::NUM_TAGS + 1);
-          newText = true;
-        } else {
-          CDC.nextDisc();
-        }
+        CDC.nextDisc();
       }
       break;
-    case 0x68: // 1 - 6
+    case 0x68: // 1 - 6, hides/shows a display tag when shuffled
       if (repeatCount == 1) {
-        uint8_t preset = msg.data[2] - 1;
-        if (CDC.isShuffled()) {
-          // hide/show display tag
-          tag = (preset == tag) ? AudioFile::NUM_TAGS : preset;
-          newText = true;
-        } else {
-          CDC.preset(preset);
-        }
+        CDC.preset(msg.data[2] - 1);
       }
       break;
     case 0x76: // RDM toggle
@@ -263,55 +312,50 @@ void displayRequest(CANClass::msg &msg) {
   // check row
   if (msg.data[0] == 0x00) {
     // check if display is wanted
-    const String text = CDC.getText(tag);
-    if (CDC.getState() == VS1053::Playing && text.length() > 0) {
+    if (CDC.getState() == VS1053::Playing && CDC.hasText()) {
       // check owner
       switch (msg.data[1]) {
-        case 0x12: // iSaab
-          // send text
+        case 0x12: { // iSaab
+          // rows with a new rendering, or both if the SID needs new text
+          uint8_t send = newText ? 0b11 : 0b00;
+          for (uint8_t row = 0; row < 2; row++) {
+            if (textSent[row] != CDC.getTextVersion(row)) {
+              textSent[row] = CDC.getTextVersion(row);
+              send |= _BV(row);
+            }
+          }
+          bool changed = send;
+
+          // step long text along at a fixed number of polls, new text starts over
+          static uint8_t polls;
+          if (changed) {
+            polls = 0;
+          } else if (++polls >= SCROLL_POLLS) {
+            polls = 0;
+            send = CDC.scrollText();
+          }
+
+          // send the rows the SID doesn't already show
+          uint8_t total = (send == 0b11) ? 6 : send ? 3 : 0;
           msg.id = TX_SID_TEXT;
-          msg.data[1] = 0x96;
+          for (uint8_t i = 0, left = total; left > 0; i++) {
+            if (bit_is_clear(send, i / 3)) continue;
+            CDC.getTextFrame(i, msg.data);
 
-          for (int8_t id = 5, i = 0; id >= 0; id--) {
             // sequence id, start of sequence flag
-            msg.data[0] = id;
-            if (id == 5) msg.data[0] |= 0x40;
-
-            // row id, new text flag
-            msg.data[2] = (id < 3) ? 2 : 1;
-            if (newText) msg.data[2] |= 0x80;
-
-            // copy text
-            switch (id) {
-              default:
-                msg.data[3] = text[i++];
-                msg.data[4] = text[i++];
-                msg.data[5] = text[i++];
-                msg.data[6] = text[i++];
-                msg.data[7] = text[i++];
-                break;
-              case 3:
-                msg.data[3] = text[i++];
-                msg.data[4] = text[i++];
-                if (text[i] == ' ') i++;
-                msg.data[5] = 0x00;
-                msg.data[6] = 0x00;
-                msg.data[7] = 0x00;
-                break;
-              case 0:
-                msg.data[3] = text[i++];
-                msg.data[4] = tag + 1;
-                msg.data[5] = 0x00;
-                msg.data[6] = 0x00;
-                msg.data[7] = 0x00;
-                break;
-            }
+            msg.data[0] = --left;
+            if (left == total - 1) msg.data[0] |= 0x40;
+
+            // new text flag
+            if (changed) msg.data[2] |= 0x80;
             sendMessage(msg);
           }
+          busSaved += (6 - total) * FRAME_BITS(8);
 
           newText = false;
           msg.data[2] = 0x05; // keep
           break;
+        }
         case 0xff: // available
           newText = true;
           msg.data[2] = 0x03; // request
@@ -339,83 +383,255 @@ void displayRequest(CANClass::msg &msg) {
 
 
 void sendMessage(const CANClass::msg &msg) {
+  busSent += FRAME_BITS(msg.header.length);
+
+#ifdef TRACEMODE
+  Trace.record(msg, true);
+#endif
+
 #ifndef SERIALMODE
-  while (!CAN.send(msg));
+  while (!CAN.send(msg)) {
+    CAN.flush();
+  }
+#ifdef LATENCYMODE
+  // timed when CAN.flush() requests it to send
+  replying(msg, CAN.queued() - 1);
+#endif
 #else
-  Serial.print(msg.id, HEX);
-  Serial.print(' ');
+  diagSend(DIAG_TX, msg);
+#ifdef LATENCYMODE
+  replying(msg, 0);
+  Latency.sent(1);
+#endif
+#endif
+}
 
-  for (uint8_t i = 0; i < 8; i++) {
-    Serial.print(msg.data[i], HEX);
-    Serial.print(' ');
-  }
 
-  Serial.println();
-#endif
+#ifdef LATENCYMODE
+// follow a reply to the frame being handled
+void replying(const CANClass::msg &msg, uint8_t ahead) {
+  if (msg.id == TX_CDC_CONTROL) {
+    Latency.replying(LatencyClass::Control, ahead);
+  } else if (msg.id == TX_CDC_POWER) {
+    Latency.replying(LatencyClass::Power, ahead);
+  }
 }
+#endif
 
 
 bool receiveMessage(CANClass::msg &msg) {
 #ifndef SERIALMODE
   return CAN.receive(msg);
 #else
-  msg.id = RX_CDC_CONTROL;
+#ifdef TRACEMODE
+  // a replayed trace takes over from the host
+  if (Trace.isReplaying()) {
+    return Trace.next(msg);
+  }
+#endif
 
-  if (Serial.available()) {
-    char c = Serial.read();
+  // host message being received, type onwards
+  static uint8_t in[2 + DIAG_PAYLOAD + 1];
+  static int8_t got = -1;
 
-    switch (c) {
-      case 'b':
-        msg.id = RX_CDC_POWER;
-        msg.data[3] = 0x03;
-        break;
-      case 'e':
-        msg.id = RX_CDC_POWER;
-        msg.data[3] = 0x08;
-        break;
-      case 't':
-        msg.id = RX_SID_REQUEST;
-        msg.data[0] = 0x00;
-        msg.data[1] = 0x12;
-        break;
-      case 'p':
-        msg.data[1] = 0xb0;
-        break;
-      case 'r':
-        msg.data[1] = 0xb1;
-        break;
-      case '*':
-        msg.data[1] = 0x76;
-        break;
-      case '>':
-        msg.data[1] = 0x35;
-        break;
-      case '<':
-        msg.data[1] = 0x36;
-        break;
-      case 'n':
-        msg.data[1] = 0x59;
-        break;
-      case '-':
-        msg.data[1] = 0x46;
-        break;
-      case '+':
-        msg.data[1] = 0x45;
+  while (Serial.available()) {
+    uint8_t c = Serial.read();
+
+    // wait for the start of a message
+    if (got < 0) {
+      if (c == DIAG_SYNC) got = 0;
+      continue;
+    }
+
+    in[got++] = c;
+    if (got == 2 && in[1] > DIAG_PAYLOAD) {
+      got = -1;
+      continue;
+    }
+    if (got < 2 || got < in[1] + 3) {
+      continue;
+    }
+    got = -1;
+
+    uint8_t check = 0;
+    for (uint8_t i = 0; i < in[1] + 3; i++) {
+      check ^= in[i];
+    }
+    if (check != 0) {
+      continue;
+    }
+
+    switch (in[0]) {
+      case DIAG_RX:
+        if (in[1] == 11) {
+          msg.id = in[2] | in[3] << 8;
+          msg.header.rtr = in[4] & 0x40;
+          msg.header.length = in[4] & 0x0f;
+          memcpy(msg.data, &in[5], 8);
+          return true;
+        }
         break;
-      case '1': case '2': case '3': case '4': case '5': case '6':
-        msg.data[1] = 0x68;
-        msg.data[2] = c - '0';
+
+      case DIAG_COMMAND:
+        diagCommand(in[2]);
         break;
     }
-  } else {
-    msg.data[1] = 0x00;
   }
 
-  return true;
+  return false;
 #endif
 }
 
 
 #ifdef SERIALMODE
+// write one diagnostics message
+void diagSend(uint8_t type, const uint8_t *payload, uint8_t length) {
+  uint8_t check = type ^ length;
+  for (uint8_t i = 0; i < length; i++) {
+    check ^= payload[i];
+  }
+
+  Serial.write(DIAG_SYNC);
+  Serial.write(type);
+  Serial.write(length);
+  Serial.write(payload, length);
+  Serial.write(check);
+}
+
+
+void diagSend(uint8_t type, const CANClass::msg &msg) {
+  uint8_t payload[11];
+  payload[0] = msg.id;
+  payload[1] = msg.id >> 8;
+  payload[2] = msg.header.length | (msg.header.rtr ? 0x40 : 0);
+  memcpy(&payload[3], msg.data, 8);
+
+  diagSend(type, payload, sizeof(payload));
+}
+
+
+// report the player status when it changes
+void diagStatus() {
+  static uint8_t last[6];
+  uint16_t time = CDC.getTime();
+  uint8_t now[6] = { CDC.getState(), CDC.isShuffled(), CDC.getDisc(), CDC.getTrack(),
+                     (uint8_t) time, (uint8_t) (time >> 8) };
+
+  if (memcmp(now, last, sizeof(now)) != 0) {
+    memcpy(last, now, sizeof(now));
+    diagSend(DIAG_STATUS, now, sizeof(now));
+  }
+}
+
+
+#ifdef STREAMMODE
+// report what the codec was fed for each track played
+void diagStream() {
+  static uint8_t last;
+  uint8_t count = CDC.getStreamCount();
+
+  if (count != last) {
+    last = count;
+
+    uint32_t length = CDC.getStreamLength();
+    uint16_t crc = CDC.getStreamCrc();
+    uint8_t payload[7];
+    payload[0] = count;
+    memcpy(&payload[1], &length, 4);
+    memcpy(&payload[5], &crc, 2);
+    diagSend(DIAG_STREAM, payload, sizeof(payload));
+  }
+}
+#endif
+
+
+void diagCommand(uint8_t c) {
+  switch (c) {
+#ifdef TRACEMODE
+    case 'y':
+      Trace.replay(processMessage);
+      break;
+#endif
+    case 'w': {
+      // worst interrupt time and bus bits, sent and without skipping steady text
+      uint32_t now = millis();
+      uint32_t counters[] = { busSent, busSaved, now - busSince };
+      uint8_t payload[2 + sizeof(counters)];
+      payload[0] = isrWorst;
+      payload[1] = isrWorst >> 8;
+      memcpy(&payload[2], counters, sizeof(counters));
+      diagSend(DIAG_COUNTERS, payload, sizeof(payload));
+
+      isrWorst = 0;
+      busSent = busSaved = 0;
+      busSince = now;
+      break;
+    }
+    case 'm': {
+      // static data, most heap and stack used, and the least free RAM between them,
+      // File objects allocate on the heap, so it grows and shrinks between polls
+      uint8_t *heapTop = &__heap_start;
+      uint8_t *deepest = heapTop;
+      for (uint8_t *p = &__heap_start; p <= (uint8_t *) RAMEND; ) {
+        // find the next painted run
+        uint8_t *run = p;
+        while (p <= (uint8_t *) RAMEND && *p == STACK_PAINT) {
+          p++;
+        }
+        if (p - run > deepest - heapTop) {
+          heapTop = run;
+          deepest = p;
+        }
+        p++;
+      }
+
+      uint16_t memory[] = { (uint16_t) (&__heap_start - (uint8_t *) RAMSTART),
+                            (uint16_t) (heapTop - &__heap_start),
+                            (uint16_t) ((uint8_t *) RAMEND + 1 - deepest),
+                            (uint16_t) (deepest - heapTop) };
+      diagSend(DIAG_MEMORY, (const uint8_t *) memory, sizeof(memory));
+      break;
+    }
+#ifdef STREAMMODE
+    case 'p': {
+      // codec throughput, time the loop waited for the codec and the codec ran dry
+      static uint32_t since;
+      uint32_t now = millis();
+      uint32_t playback[4];
+      CDC.takeThroughput(playback);
+      playback[3] = now - since;
+      since = now;
+      diagSend(DIAG_PLAYBACK, (const uint8_t *) playback, sizeof(playback));
+      break;
+    }
+#endif
+#ifdef SPISTATSMODE
+    case 's': {
+      // time each device held the bus
+      static uint32_t since;
+      uint32_t now = millis();
+      uint32_t elapsed = now - since;
+      uint8_t payload[NUM_SPI_TIMED * 6 + 4];
+      SPIBus.take(payload);
+      memcpy(&payload[NUM_SPI_TIMED * 6], &elapsed, 4);
+      since = now;
+      diagSend(DIAG_SPI, payload, sizeof(payload));
+      break;
+    }
+#endif
+#ifdef LATENCYMODE
+    case 'l':
+      for (uint8_t i = 0; i < LatencyClass::NUM_POINTS; i++) {
+        uint8_t payload[17];
+        payload[0] = i;
+        Latency.take(i, &payload[1]);
+        diagSend(DIAG_LATENCY, payload, sizeof(payload));
+      }
+      break;
+#endif
+  }
+}
+
+
 ISR(TIMER1_COMPA_vect) { processMessage(); }
 #endif
@@ -0,0 +1,239 @@
+// AudioFile against the corpus, then against damaged copies of it
+
+#include <signal.h>
+#include <unistd.h>
+#include <string>
+#include <vector>
+#include <util/crc16.h>
+#include "check.h"
+#include "play.h"
+
+// reads and seeks a well-formed corpus file stays far below
+#define BUDGET 100000
+
+// seconds per file, for loops that never leave the cached block
+#define WATCHDOG 5
+
+struct Expected {
+  std::string name;
+  std::string length;
+  std::string crc;
+  std::string tags[3];
+};
+
+static const AudioFile::Tag checkedTags[3] = { AudioFile::Title, AudioFile::Artist, AudioFile::Album };
+static std::string dir = "corpus/";
+static const char *playing;
+
+
+static void watchdog(int sig) {
+  printf("%s: no end in sight\n", playing);
+  fflush(stdout);
+  _exit(1);
+}
+
+
+static std::vector<Expected> readManifest() {
+  std::vector<Expected> files;
+  FILE *f = fopen((dir + "expected.txt").c_str(), "r");
+  char line[256];
+
+  while (f && fgets(line, sizeof(line), f)) {
+    if (line[0] == '#') {
+      continue;
+    }
+
+    // tab separated, empty fields count
+    std::vector<std::string> fields(1);
+    for (char *c = line; *c && *c != '\n'; c++) {
+      if (*c == '\t') {
+        fields.push_back("");
+      } else {
+        fields.back() += *c;
+      }
+    }
+    fields.resize(6);
+
+    Expected e;
+    e.name = fields[0];
+    e.length = fields[1];
+    e.crc = fields[2];
+    for (uint8_t i = 0; i < 3; i++) {
+      e.tags[i] = fields[3 + i];
+    }
+    files.push_back(e);
+  }
+
+  if (f) {
+    fclose(f);
+  }
+  return files;
+}
+
+
+static std::vector<uint8_t> load(const std::string &path) {
+  File f = SD.open(path.c_str());
+  std::vector<uint8_t> data(f.size());
+  f.read(data.data(), data.size());
+  return data;
+}
+
+
+static uint16_t crc(const std::vector<uint8_t> &data) {
+  uint16_t c = 0xffff;
+  for (size_t i = 0; i < data.size(); i++) {
+    c = _crc_ccitt_update(c, data[i]);
+  }
+  return c;
+}
+
+
+// play within the budget, false if the parser ran away
+static bool finishes(const char *name, Played *played = NULL) {
+  playing = name;
+  alarm(WATCHDOG);
+  host::sdBudget = BUDGET;
+  try {
+    Played p = play(name);
+    if (played) {
+      *played = p;
+    }
+  } catch (host::Hang) {
+    printf("%s: no end in sight\n", name);
+    host::sdBudget = 0;
+    return false;
+  }
+
+  host::sdBudget = 0;
+  alarm(0);
+  return true;
+}
+
+
+static void testCorpus(const std::vector<Expected> &files) {
+  for (size_t i = 0; i < files.size(); i++) {
+    const Expected &e = files[i];
+    std::string path = dir + e.name;
+    Played p;
+
+    CHECK(finishes(path.c_str(), &p));
+    CHECK(p.opened);
+
+    if (e.length != "-") {
+      char want[8];
+      snprintf(want, sizeof(want), "%04x", crc(p.stream));
+      if (std::to_string(p.stream.size()) != e.length || e.crc != want) {
+        printf("%s: stream is %zu bytes, crc %s\n", e.name.c_str(), p.stream.size(), want);
+      }
+      CHECK_EQ(std::to_string(p.stream.size()), e.length);
+      CHECK_EQ(e.crc, std::string(want));
+    }
+
+    for (uint8_t t = 0; t < 3; t++) {
+      if (e.tags[t] != "-" && p.tags[checkedTags[t]] != e.tags[t]) {
+        printf("%s: tag %d is '%s'\n", e.name.c_str(), t, p.tags[checkedTags[t]].c_str());
+        failures++;
+      }
+    }
+  }
+}
+
+
+// every well-formed file given up after its first metadata block, then played in full
+static void testReopened(const std::vector<Expected> &files) {
+  static AudioFile audio;
+
+  for (size_t i = 0; i < files.size(); i++) {
+    const Expected &e = files[i];
+    if (e.length == "-") {
+      continue;
+    }
+
+    std::string path = dir + e.name;
+    uint8_t *buf;
+    audio = SD.open(path.c_str());
+    audio.readMetadata(buf);
+    audio.close();
+
+    Played p;
+    CHECK(finishes(path.c_str(), &p));
+    char want[8];
+    snprintf(want, sizeof(want), "%04x", crc(p.stream));
+    if (std::to_string(p.stream.size()) != e.length || e.crc != want) {
+      printf("%s: stream after a reopen is %zu bytes, crc %s\n", e.name.c_str(), p.stream.size(), want);
+      failures++;
+    }
+  }
+}
+
+
+// every well-formed file cut short at each length up to the first few blocks
+static void testTruncated(const std::vector<Expected> &files) {
+  for (size_t i = 0; i < files.size(); i++) {
+    if (files[i].length == "-") {
+      continue;
+    }
+
+    std::vector<uint8_t> data = load(dir + files[i].name);
+    for (size_t n = 0; n < data.size(); n += (n < 1100) ? 1 : 37) {
+      std::string name = "cut-" + files[i].name;
+      host::addFile(name.c_str(), std::vector<uint8_t>(data.begin(), data.begin() + n));
+      if (!finishes(name.c_str())) {
+        printf("  cut to %zu bytes\n", n);
+        failures++;
+        break;
+      }
+    }
+  }
+}
+
+
+// every well-formed file with one header byte made as large or small as it gets,
+// which turns each size and count field oversized or undersized in turn
+static void testDamaged(const std::vector<Expected> &files) {
+  static const uint8_t values[] = { 0x00, 0x01, 0x7f, 0x80, 0xff };
+
+  for (size_t i = 0; i < files.size(); i++) {
+    if (files[i].length == "-") {
+      continue;
+    }
+
+    std::vector<uint8_t> data = load(dir + files[i].name);
+    size_t limit = min(data.size(), (size_t) 1100);
+    bool ok = true;
+
+    for (size_t pos = 0; ok && pos < limit; pos++) {
+      for (uint8_t v = 0; ok && v < sizeof(values); v++) {
+        std::vector<uint8_t> bad = data;
+        bad[pos] = values[v];
+
+        std::string name = "bad-" + files[i].name;
+        host::addFile(name.c_str(), bad);
+        if (!finishes(name.c_str())) {
+          printf("  byte %zu set to %02x\n", pos, values[v]);
+          failures++;
+          ok = false;
+        }
+      }
+    }
+  }
+}
+
+
+int main(int argc, char *argv[]) {
+  if (argc > 1) {
+    dir = std::string(argv[1]) + "/";
+  }
+
+  signal(SIGALRM, watchdog);
+
+  std::vector<Expected> files = readManifest();
+  CHECK(!files.empty());
+
+  testCorpus(files);
+  testReopened(files);
+  testTruncated(files);
+  testDamaged(files);
+
+  return report("audiofile_test");
+}
@@ -0,0 +1,692 @@
+// timed models of the codec, the CAN controller and the card, see board.h
+
+#include "board.h"
+
+#define NEVER UINT64_MAX
+
+// ns for a number of CPU cycles
+#define CYCLES_NS(n) ((uint64_t) (n) * 1000000000 / F_CPU)
+
+// bytes clocked per block read: command, data token, data and CRC
+#define BLOCK_BYTES (6 + 1 + 512 + 2)
+
+
+Board::Board(const CardModel &card) : card(card) {
+  onStream = NULL;
+  now = waiting = asleep = 0;
+  interrupts = overflows = dropped = 0;
+  endAt = NEVER;
+  inInterrupt = cardBusy = false;
+  lastNode = NULL;
+  lastBlock = 0;
+  playing = NULL;
+  codecOn = false;
+  busy = false;
+  canCount = 0;
+  codecReset();
+  canReset();
+}
+
+
+bool Board::loadScript(const char *path) {
+  FILE *f = fopen(path, "r");
+  if (!f) {
+    return false;
+  }
+
+  char line[256];
+  uint64_t at = now;
+  while (fgets(line, sizeof(line), f)) {
+    char *hash = strchr(line, '#');
+    if (hash) {
+      *hash = '\0';
+    }
+
+    char *word = strtok(line, " \t\r\n");
+    char *id = strtok(NULL, " \t\r\n");
+    if (!word || !id) {
+      continue;
+    }
+
+    Frame frame = {};
+    at += strtoul(word, NULL, 10) * 1000000;
+    frame.at = at;
+    frame.id = strtoul(id, NULL, 16);
+    while ((word = strtok(NULL, " \t\r\n")) != NULL) {
+      if (!strcmp(word, "r")) {
+        frame.rtr = true;
+      } else if (frame.length < 8) {
+        frame.data[frame.length++] = strtoul(word, NULL, 16);
+      }
+    }
+
+    script.push_back(frame);
+  }
+
+  fclose(f);
+  return true;
+}
+
+
+void Board::inject(uint32_t ms, uint16_t id, const uint8_t *data, uint8_t length) {
+  Frame frame = {};
+  frame.at = now + (uint64_t) ms * 1000000;
+  frame.id = id;
+  frame.length = length;
+  memcpy(frame.data, data, length);
+
+  std::deque<Frame>::iterator i = script.begin();
+  while (i != script.end() && i->at <= frame.at) {
+    i++;
+  }
+  script.insert(i, frame);
+}
+
+
+void Board::setRate(const host::Node *file, uint32_t rate, uint16_t reported) {
+  Rate r = { rate, reported };
+  rates[file] = r;
+}
+
+
+void Board::run(void (*setup)(), void (*loop)(), uint32_t ms) {
+  endAt = (uint64_t) ms * 1000000;
+  host::board = this;
+
+  try {
+    setup();
+    for (;;) {
+      loop();
+    }
+  } catch (End) {
+  }
+
+  host::board = NULL;
+  inInterrupt = false;
+  if (active) {
+    streams.back().end = now;
+  }
+}
+
+
+// move the clock on, running the bus and taking interrupts on the way,
+// idle adds up the time that isn't spent in them
+void Board::advance(uint64_t ns, uint64_t *idle) {
+  uint64_t until = now + ns;
+
+  while (now < until) {
+    uint64_t t = min(min(until, busNext()), endAt);
+    if (idle) {
+      *idle += t - now;
+    }
+    now = t;
+    host::clock = now / 1000;
+
+    busRun();
+    if (now >= endAt) {
+      throw End();
+    }
+    interrupt();
+  }
+}
+
+
+// the CAN controller's INT is level triggered, its handler runs for as long
+// as INT is low and nothing holds it off
+void Board::interrupt() {
+  while (!inInterrupt && host::handlers[MCP2515_INT] && !masked() && canInt()) {
+    inInterrupt = true;
+    interrupts++;
+    host::handlers[MCP2515_INT]();
+    inInterrupt = false;
+  }
+}
+
+
+bool Board::masked() {
+  return cardBusy || (host::spiClock && (host::spiInterrupts & _BV(MCP2515_INT)));
+}
+
+
+uint8_t Board::transfer(uint8_t c) {
+  uint8_t back = 0xff;
+
+  if (host::pins[MCP2515_CS] == LOW) {
+    back = canTransfer(c);
+  } else if (host::pins[VS1053_XCS] == LOW) {
+    back = sciTransfer(c);
+  } else if (host::pins[VS1053_XDCS] == LOW) {
+    sdiTransfer(c);
+  }
+
+  // the AVR clocks SPI at F_CPU over a power of 2 from 2 to 128, the fastest
+  // within the transaction's, and takes a few cycles to load the next byte
+  uint32_t div = 2;
+  while (div < 128 && F_CPU / div > host::spiClock) {
+    div <<= 1;
+  }
+  advance(CYCLES_NS(8 * div + 4));
+
+  return back;
+}
+
+
+uint8_t Board::read(uint8_t pin) {
+  switch (pin) {
+    case VS1053_XDREQ:
+      host::pins[pin] = codecReady();
+      if (!host::pins[pin]) {
+        advance(POLL_NS, &waiting);
+      }
+      break;
+
+    case MCP2515_IRQ:
+      host::pins[pin] = !canInt();
+      break;
+  }
+
+  return host::pins[pin];
+}
+
+
+void Board::written(uint8_t pin) {
+  switch (pin) {
+    case VS1053_XRESET:
+      if (host::pins[pin] == LOW) {
+        codecOn = false;
+        codecReset();
+      } else if (!codecOn) {
+        codecOn = true;
+        bootAt = now + BOOT_NS;
+      }
+      break;
+
+    case VS1053_XCS:
+      sciCount = 0;
+      break;
+
+    case MCP2515_CS:
+      if (host::pins[pin] == HIGH) {
+        canDeselect();
+      }
+      canCount = 0;
+      break;
+  }
+}
+
+
+void Board::wait(unsigned long us) {
+  advance((uint64_t) us * 1000);
+}
+
+
+void Board::released() {
+  interrupt();
+}
+
+
+// power down until an interrupt has been taken
+void Board::sleep() {
+  uint32_t before = interrupts;
+
+  while (interrupts == before) {
+    uint64_t next = min(busNext(), endAt);
+    advance(next > now ? next - now : 1000, &asleep);
+  }
+}
+
+
+//----------------------------------------------------------------------------
+// CARD
+//----------------------------------------------------------------------------
+
+void Board::cardInit() {
+  cardBusy = true;
+  advance((uint64_t) card.initUs * 1000);
+  cardBusy = false;
+  interrupt();
+
+  lastNode = NULL;
+}
+
+
+uint64_t Board::blockNs(bool follows) {
+  uint64_t ns = (uint64_t) card.accessUs * 1000 + BLOCK_BYTES * CYCLES_NS(8 * 2 + 4);
+  return follows ? ns : ns + (uint64_t) card.seekUs * 1000;
+}
+
+
+void Board::cardRead(const host::Node *node, uint32_t block) {
+  bool follows = node == lastNode && block == lastBlock + 1;
+  uint64_t ns = 0;
+
+  // crossing into another cluster looks it up in the FAT first
+  if (!node->directory && block % card.clusterBlocks == 0 && block > 0) {
+    ns += blockNs(false);
+    follows = follows && !card.fragmented;
+  }
+  ns += blockNs(follows);
+
+  cardBusy = true;
+  advance(ns);
+  cardBusy = false;
+  interrupt();
+
+  lastNode = node;
+  lastBlock = block;
+  if (rates.count(node)) {
+    playing = node;
+  }
+}
+
+
+//----------------------------------------------------------------------------
+// CODEC
+//----------------------------------------------------------------------------
+
+void Board::codecReset() {
+  memset(sci, 0, sizeof(sci));
+  sci[SCI_MODE] = SM_SDINEW;
+  sci[SCI_STATUS] = 0x40;
+  wramAddr = 0;
+  sciCount = 0;
+  level = consumed = decodeBase = 0;
+  levelAt = now;
+  active = filled = false;
+  cancelLeft = 0;
+}
+
+
+// play what the buffer holds up to now
+void Board::drain() {
+  if (active && rate.rate && now > levelAt) {
+    double ns = now - levelAt;
+    double want = ns * rate.rate / 1e9;
+    if (want >= level) {
+      if (filled) {
+        streams.back().starved += ns - level * 1e9 / rate.rate;
+      }
+      consumed += level;
+      level = 0;
+    } else {
+      consumed += want;
+      level -= want;
+    }
+  }
+  levelAt = now;
+}
+
+
+bool Board::codecReady() {
+  if (!codecOn || now < bootAt) {
+    return false;
+  }
+
+  drain();
+  return level + VS1053_BUFFER_SIZE <= VS1053_FIFO_SIZE;
+}
+
+
+uint8_t Board::sciTransfer(uint8_t c) {
+  uint8_t back = 0x00;
+
+  switch (sciCount++) {
+    case 0:
+      sciOp = c;
+      break;
+    case 1:
+      sciAddr = c & 0x0f;
+      if (sciOp == VS_READ_COMMAND) {
+        sciValue = sciRead(sciAddr);
+      }
+      break;
+    case 2:
+      if (sciOp == VS_READ_COMMAND) {
+        back = sciValue >> 8;
+      } else {
+        sciValue = c << 8;
+      }
+      break;
+    case 3:
+      if (sciOp == VS_READ_COMMAND) {
+        back = sciValue;
+      } else {
+        sciWrite(sciAddr, sciValue | c);
+      }
+      break;
+  }
+
+  return back;
+}
+
+
+uint16_t Board::sciRead(uint8_t addr) {
+  switch (addr) {
+    case SCI_DECODETIME:
+      drain();
+      return rate.rate ? (uint16_t) ((consumed - decodeBase) / rate.rate) : 0;
+
+    case SCI_WRAM:
+      return (wramAddr == XP_BYTERATE) ? rate.reported : 0;
+
+    case SCI_HDAT0:
+    case SCI_HDAT1:
+      return 0;
+  }
+
+  return sci[addr];
+}
+
+
+void Board::sciWrite(uint8_t addr, uint16_t value) {
+  switch (addr) {
+    case SCI_MODE:
+      if ((value & SM_CANCEL) && !active) {
+        value &= ~SM_CANCEL;
+      } else if (value & SM_CANCEL) {
+        cancelLeft = CANCEL_BYTES;
+      }
+      break;
+
+    case SCI_DECODETIME:
+      drain();
+      decodeBase = consumed;
+      break;
+
+    case SCI_WRAMADDR:
+      wramAddr = value;
+      break;
+  }
+
+  sci[addr] = value;
+}
+
+
+void Board::sdiTransfer(uint8_t c) {
+  drain();
+
+  if (!active) {
+    // a new stream at the byte rate of the file last read from the card
+    Rate none = { 0, 0 };
+    rate = rates.count(playing) ? rates[playing] : none;
+    active = true;
+    filled = false;
+    consumed = decodeBase = 0;
+
+    Stream stream = { playing, now, 0, 0, 0 };
+    streams.push_back(stream);
+    if (onStream) {
+      onStream(*this, streams.size() - 1);
+    }
+  }
+
+  if (level + 1 > VS1053_FIFO_SIZE) {
+    overflows++;
+  } else {
+    level++;
+  }
+  streams.back().bytes++;
+  filled |= streams.back().bytes >= VS1053_FIFO_SIZE;
+
+  if (cancelLeft > 0 && --cancelLeft == 0) {
+    sci[SCI_MODE] &= ~SM_CANCEL;
+    streams.back().end = now;
+    active = false;
+    level = 0;
+  }
+}
+
+
+//----------------------------------------------------------------------------
+// CAN CONTROLLER
+//----------------------------------------------------------------------------
+
+void Board::canReset() {
+  memset(regs, 0, sizeof(regs));
+  regs[CANSTAT] = CANClass::Config;
+  regs[CANCTRL] = CANClass::Config | _BV(CLKEN) | _BV(CLKPRE1) | _BV(CLKPRE0);
+}
+
+
+uint8_t Board::canTransfer(uint8_t c) {
+  if (canCount++ == 0) {
+    canOp = c;
+
+    if (c == SPI_RESET) {
+      canReset();
+    } else if ((c & 0xf8) == SPI_RTS) {
+      for (uint8_t n = 0; n < 3; n++) {
+        if (bit_is_set(c, n)) {
+          regs[TXB0CTRL + 0x10 * n] |= _BV(TXREQ);
+          requestedAt[n] = now;
+        }
+      }
+    } else if ((c & 0xf9) == SPI_READ_RX) {
+      // RXBnSIDH or RXBnD0
+      canAddr = RXB0SIDH + 0x10 * ((c >> 2) & 1) + ((c & 0x02) ? 5 : 0);
+    } else if ((c & 0xf8) == SPI_WRITE_TX) {
+      // TXBnSIDH or TXBnD0
+      canAddr = TXB0SIDH + 0x10 * ((c >> 1) & 3) + ((c & 0x01) ? 5 : 0);
+    }
+    return 0xff;
+  }
+
+  if (canOp == SPI_READ_STATUS) {
+    uint8_t f = regs[CANINTF];
+    uint8_t status = f & (_BV(RX0IF) | _BV(RX1IF));
+    for (uint8_t n = 0; n < 3; n++) {
+      if (bit_is_set(regs[TXB0CTRL + 0x10 * n], TXREQ)) status |= _BV(2 + 2 * n);
+      if (bit_is_set(f, TX0IF + n)) status |= _BV(3 + 2 * n);
+    }
+    return status;
+  }
+
+  if (canOp == SPI_RX_STATUS) {
+    return (regs[CANINTF] & (_BV(RX0IF) | _BV(RX1IF))) << 6;
+  }
+
+  if (canOp == SPI_READ || canOp == SPI_WRITE || canOp == SPI_BIT_MODIFY) {
+    switch (canCount) {
+      case 2:
+        canAddr = c & 0x7f;
+        return 0xff;
+      case 3:
+        if (canOp == SPI_BIT_MODIFY) {
+          canMask = c;
+          return 0xff;
+        }
+        break;
+      case 4:
+        if (canOp == SPI_BIT_MODIFY) {
+          canWrite(canAddr, (regs[canAddr] & ~canMask) | (c & canMask));
+          return 0xff;
+        }
+        break;
+      default:
+        if (canOp == SPI_BIT_MODIFY) {
+          return 0xff;
+        }
+    }
+  }
+
+  if (canOp == SPI_READ || (canOp & 0xf9) == SPI_READ_RX) {
+    return regs[canAddr++ & 0x7f];
+  }
+  if (canOp == SPI_WRITE) {
+    canWrite(canAddr++ & 0x7f, c);
+  } else if ((canOp & 0xf8) == SPI_WRITE_TX) {
+    regs[canAddr++ & 0x7f] = c;
+  }
+  return 0xff;
+}
+
+
+// reading out an RX buffer frees it when chip select goes high
+void Board::canDeselect() {
+  if (canCount > 1 && (canOp & 0xf9) == SPI_READ_RX) {
+    regs[CANINTF] &= ~_BV((canOp >> 2) & 1);
+  }
+}
+
+
+void Board::canWrite(uint8_t addr, uint8_t value) {
+  switch (addr) {
+    case CANSTAT:
+      return;
+
+    case CANCTRL:
+      // modes change at once
+      regs[CANSTAT] = (regs[CANSTAT] & ~0xe0) | (value & 0xe0);
+      break;
+  }
+
+  regs[addr] = value;
+}
+
+
+// TX buffer to send next, -1 if none, the highest priority then the highest buffer
+int8_t Board::txNext() {
+  int8_t next = -1;
+
+  if (canMode() != CANClass::Normal) {
+    return next;
+  }
+
+  for (int8_t n = 2; n >= 0; n--) {
+    uint8_t ctrl = regs[TXB0CTRL + 0x10 * n];
+    if (bit_is_set(ctrl, TXREQ)
+        && (next < 0 || (ctrl & 0x03) > (regs[TXB0CTRL + 0x10 * next] & 0x03))) {
+      next = n;
+    }
+  }
+  return next;
+}
+
+
+bool Board::accepts(uint8_t buffer, uint16_t id) {
+  uint8_t ctrl = regs[RXB0CTRL + 0x10 * buffer];
+  if ((ctrl & (_BV(RXM1) | _BV(RXM0))) == (_BV(RXM1) | _BV(RXM0))) {
+    return true;
+  }
+
+  // RXB0 has RXF0-1 and RXM0, RXB1 has RXF2-5 and RXM1
+  uint8_t m = buffer ? RXM1SIDH : RXM0SIDH;
+  uint16_t mask = regs[m] << 3 | regs[m + 1] >> 5;
+  static const uint8_t filters[] = { RXF0SIDH, RXF1SIDH, RXF2SIDH, RXF3SIDH, RXF4SIDH, RXF5SIDH };
+  for (uint8_t i = buffer ? 2 : 0; i < (buffer ? 6 : 2); i++) {
+    uint8_t f = filters[i];
+    uint16_t filter = regs[f] << 3 | regs[f + 1] >> 5;
+    if (((id ^ filter) & mask) == 0) {
+      return true;
+    }
+  }
+  return false;
+}
+
+
+void Board::receive(const Frame &frame) {
+  uint8_t mode = canMode();
+  if (mode == CANClass::Sleep) {
+    regs[CANINTF] |= _BV(WAKIF);
+    return;
+  }
+  if (mode == CANClass::Config) {
+    return;
+  }
+
+  int8_t buffer = -1;
+  if (accepts(0, frame.id)) {
+    if (bit_is_clear(regs[CANINTF], RX0IF)) {
+      buffer = 0;
+    } else if (bit_is_set(regs[RXB0CTRL], BUKT) && bit_is_clear(regs[CANINTF], RX1IF)) {
+      buffer = 1;
+    }
+  } else if (accepts(1, frame.id)) {
+    if (bit_is_clear(regs[CANINTF], RX1IF)) {
+      buffer = 1;
+    }
+  } else {
+    return;
+  }
+
+  Frame got = frame;
+  got.at = now;
+  received.push_back(got);
+
+  if (buffer < 0) {
+    dropped++;
+    return;
+  }
+
+  uint8_t *b = &regs[RXB0SIDH + 0x10 * buffer];
+  b[0] = frame.id >> 3;
+  b[1] = (frame.id << 5) | (frame.rtr ? _BV(SRR) : 0);
+  b[2] = b[3] = 0;
+  b[4] = frame.length;
+  memcpy(&b[5], frame.data, 8);
+  regs[CANINTF] |= _BV(RX0IF + buffer);
+}
+
+
+// when the bus next has something to do
+uint64_t Board::busNext() {
+  if (busy) {
+    return busEnd;
+  }
+  if (txNext() >= 0) {
+    return now;
+  }
+  if (!script.empty()) {
+    return max(script.front().at, now);
+  }
+  return NEVER;
+}
+
+
+// finish the frame on the bus and start the next one, the lowest id wins
+void Board::busRun() {
+  for (;;) {
+    if (busy && busEnd <= now) {
+      busy = false;
+      if (busTx >= 0) {
+        regs[TXB0CTRL + 0x10 * busTx] &= ~_BV(TXREQ);
+        regs[CANINTF] |= _BV(TX0IF + busTx);
+        busFrame.at = now;
+        sent.push_back(busFrame);
+      } else {
+        receive(busFrame);
+      }
+    }
+    if (busy) {
+      return;
+    }
+
+    int8_t tx = txNext();
+    bool rx = !script.empty() && script.front().at <= now;
+    if (tx < 0 && !rx) {
+      return;
+    }
+
+    Frame frame = {};
+    if (tx >= 0) {
+      const uint8_t *b = &regs[TXB0SIDH + 0x10 * tx];
+      frame.requested = requestedAt[tx];
+      frame.id = b[0] << 3 | b[1] >> 5;
+      frame.rtr = bit_is_set(b[4], RTR);
+      frame.length = min(b[4] & 0x0f, 8);
+      memcpy(frame.data, &b[5], 8);
+    }
+    if (rx && (tx < 0 || script.front().id < frame.id)) {
+      frame = script.front();
+      script.pop_front();
+      tx = -1;
+    }
+
+    // the frame then the interframe space, without stuffing
+    uint8_t bits = FRAME_BITS(frame.rtr ? 0 : frame.length) + 3;
+    busy = true;
+    busTx = tx;
+    busFrame = frame;
+    busEnd = now + (uint64_t) bits * 1000000000 / IBUS_BITRATE;
+  }
+}
@@ -0,0 +1,176 @@
+// timed models of the chips on the module, behind the stubs
+//   - a virtual clock in nanoseconds, moved on by bus bytes, card reads and delays,
+//     and by the playback loop's turns while it waits for DREQ
+//   - VS1053: the SCI registers the sketch uses, a VS1053_FIFO_SIZE SDI buffer
+//     drained at the byte rate of the file being played, DREQ high while
+//     VS1053_BUFFER_SIZE bytes fit, the cancel taken after two chunks of fill
+//   - MCP2515: its SPI instructions, filters, RX and TX buffers and the INT line,
+//     on a bus at the I-Bus bitrate shared with frames from a script
+//   - card: access time and transfer per block read, a FAT read at each cluster
+//     boundary, and a seek for any block that doesn't follow the last one read,
+//     which on a fragmented card includes every cluster boundary
+//   - the card and the SPI transactions hold off the CAN interrupt, as on the AVR
+//   - the CPU time between bus operations is not modeled
+#ifndef BOARD_H
+#define BOARD_H
+
+#include <deque>
+#include <map>
+#include <Arduino.h>
+#include <SD.h>
+#include "../CAN.h"
+#include "../CDC.h"
+#include "../iSaab.h"
+
+// a turn of the playback loop's wait for DREQ, update() included
+#define POLL_NS       4000
+
+// from VS1053 reset to DREQ
+#define BOOT_NS       1800000
+
+// bytes of fill the codec takes before it acts on SM_CANCEL
+#define CANCEL_BYTES  (2 * VS1053_BUFFER_SIZE)
+
+#define IBUS_BITRATE  47619
+
+struct CardModel {
+  const char *name;
+  uint32_t initUs;         // SD.begin
+  uint32_t accessUs;       // block read command to data
+  uint32_t seekUs;         // more for a block that doesn't follow the last one
+  uint16_t clusterBlocks;
+  bool fragmented;         // no two clusters of a file are adjacent
+};
+
+class Board : public host::Board
+{
+  public:
+    struct End {};
+
+    // ns are from power up, frames from the script are ready to go at 'at',
+    // sent ones are requested to send at 'requested' and done at 'at'
+    struct Frame {
+      uint64_t at;
+      uint64_t requested;
+      uint16_t id;
+      bool rtr;
+      uint8_t length;
+      uint8_t data[8];
+    };
+
+    // what the codec got from the first SDI byte of a track to its cancel,
+    // starved is the time it ran dry once it had been sent a buffer's worth
+    struct Stream {
+      const host::Node *file;
+      uint64_t start;
+      uint64_t end;
+      uint32_t bytes;
+      uint64_t starved;
+    };
+
+    explicit Board(const CardModel &card);
+
+    // frames to receive, in the data/diag.py script format, delays from the frame before
+    bool loadScript(const char *path);
+    void inject(uint32_t ms, uint16_t id, const uint8_t *data, uint8_t length);
+
+    // bytes per second the codec plays a file at, and what it reports in XP_BYTERATE
+    void setRate(const host::Node *file, uint32_t rate, uint16_t reported);
+
+    // called as stream i starts
+    void (*onStream)(Board &board, size_t i);
+
+    // setup() and loop() until ms after power up
+    void run(void (*setup)(), void (*loop)(), uint32_t ms);
+
+    uint64_t now;
+    uint64_t waiting;      // in the playback loop's wait for DREQ
+    uint64_t asleep;
+    uint32_t interrupts;
+    uint32_t overflows;    // SDI bytes the codec had no room for
+    uint32_t dropped;      // frames lost to full RX buffers
+    std::vector<Stream> streams;
+    std::vector<Frame> received;
+    std::vector<Frame> sent;
+
+    // host::Board
+    uint8_t transfer(uint8_t c);
+    uint8_t read(uint8_t pin);
+    void written(uint8_t pin);
+    void wait(unsigned long us);
+    void sleep();
+    void released();
+    void cardInit();
+    void cardRead(const host::Node *node, uint32_t block);
+
+  private:
+    void advance(uint64_t ns, uint64_t *idle = NULL);
+    void interrupt();
+    bool masked();
+    uint64_t endAt;
+    bool inInterrupt;
+    bool cardBusy;
+
+    // card
+    CardModel card;
+    const host::Node *lastNode;
+    uint32_t lastBlock;
+    uint64_t blockNs(bool follows);
+
+    // codec
+    struct Rate {
+      uint32_t rate;
+      uint16_t reported;
+    };
+    std::map<const host::Node *, Rate> rates;
+    const host::Node *playing;
+    uint64_t bootAt;
+    bool codecOn;
+    uint16_t sci[16];
+    uint16_t wramAddr;
+    uint8_t sciCount;
+    uint8_t sciOp;
+    uint8_t sciAddr;
+    uint16_t sciValue;
+    double level;
+    double consumed;
+    double decodeBase;
+    uint64_t levelAt;
+    Rate rate;
+    bool active;
+    bool filled;
+    uint16_t cancelLeft;
+    void codecReset();
+    void drain();
+    bool codecReady();
+    uint8_t sciTransfer(uint8_t c);
+    uint16_t sciRead(uint8_t addr);
+    void sciWrite(uint8_t addr, uint16_t value);
+    void sdiTransfer(uint8_t c);
+
+    // CAN controller and bus
+    uint8_t regs[128];
+    uint8_t canCount;
+    uint8_t canOp;
+    uint8_t canAddr;
+    uint8_t canMask;
+    uint64_t requestedAt[3];
+    std::deque<Frame> script;
+    bool busy;
+    int8_t busTx;
+    Frame busFrame;
+    uint64_t busEnd;
+    void canReset();
+    uint8_t canTransfer(uint8_t c);
+    void canDeselect();
+    void canWrite(uint8_t addr, uint8_t value);
+    uint8_t canMode() { return regs[CANSTAT] & (_BV(REQOP2) | _BV(REQOP1) | _BV(REQOP0)); }
+    bool canInt() { return regs[CANINTF] & regs[CANINTE]; }
+    int8_t txNext();
+    bool accepts(uint8_t buffer, uint16_t id);
+    void receive(const Frame &frame);
+    uint64_t busNext();
+    void busRun();
+};
+
+#endif // BOARD_H
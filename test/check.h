@@ -0,0 +1,30 @@
+// just enough of a test framework for the host build
+#ifndef CHECK_H
+#define CHECK_H
+
+#include <stdio.h>
+
+static int failures;
+
+#define CHECK(cond) \
+  do { \
+    if (!(cond)) { \
+      printf("%s:%d: failed: %s\n", __FILE__, __LINE__, #cond); \
+      failures++; \
+    } \
+  } while (0)
+
+#define CHECK_EQ(got, want) \
+  do { \
+    if (!((got) == (want))) { \
+      printf("%s:%d: failed: %s == %s\n", __FILE__, __LINE__, #got, #want); \
+      failures++; \
+    } \
+  } while (0)
+
+static int report(const char *name) {
+  printf("%s: %s\n", name, failures ? "FAILED" : "ok");
+  return failures ? 1 : 0;
+}
+
+#endif // CHECK_H
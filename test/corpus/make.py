@@ -0,0 +1,318 @@
+#!/usr/bin/env python3
+"""
+Writes the AudioFile test corpus into this directory, run it after changing it:
+
+  test/corpus/make.py
+
+Each file is built from scratch so the expected codec stream is known
+independently of the parsers. expected.txt has a line per file:
+
+  name  stream length  stream crc  title  artist  album
+
+where the stream is what VS1053::playTrack should send before the end fill
+and the crc is CRC-CCITT as _crc_ccitt_update computes it from 0xffff.
+Malformed files only have to be parsed in bounded time, '-' marks what is
+not checked.
+"""
+
+import os
+import struct
+
+HERE = os.path.dirname(os.path.abspath(__file__))
+
+
+def crc_ccitt(data):
+    crc = 0xffff
+    for b in data:
+        crc ^= b
+        for _ in range(8):
+            crc = (crc >> 1) ^ 0x8408 if crc & 1 else crc >> 1
+    return crc
+
+
+def audio(n, seed=1):
+    # stand-in for coded audio, anything but a format's magic number
+    return bytes((i * 31 + seed * 7 + (i >> 5)) & 0xff for i in range(n))
+
+
+# ID3v2
+
+
+def syncsafe(n):
+    return bytes((n >> s) & 0x7f for s in (21, 14, 7, 0))
+
+
+def id3_frame(ident, text, enc=3, ver=3):
+    body = bytes([enc]) + text
+    if ver == 2:
+        return ident + struct.pack('>I', len(body))[1:] + body
+    size = syncsafe(len(body)) if ver == 4 else struct.pack('>I', len(body))
+    return ident + size + b'\0\0' + body
+
+
+def id3(frames, ver=3, size=None):
+    body = b''.join(frames)
+    return b'ID3' + bytes([ver, 0, 0]) + syncsafe(len(body) if size is None else size) + body
+
+
+# FLAC
+
+
+def flac_block(kind, body, last=False):
+    return bytes([kind | (0x80 if last else 0)]) + struct.pack('>I', len(body))[1:] + body
+
+
+def vorbis_comments(fields, count=None):
+    body = struct.pack('<I', 6) + b'iSaab '
+    body += struct.pack('<I', len(fields) if count is None else count)
+    for f in fields:
+        body += struct.pack('<I', len(f)) + f
+    return body
+
+
+def flac(blocks, frames):
+    streaminfo = flac_block(0, bytes(range(34)))
+    head = b'fLaC' + streaminfo
+    meta = b''.join(blocks)
+    # the codec gets STREAMINFO, then the frames
+    return head + meta + frames, head + frames
+
+
+# Ogg
+
+
+def ogg_crc(data):
+    crc = 0
+    for b in data:
+        crc ^= b << 24
+        for _ in range(8):
+            crc = ((crc << 1) ^ 0x04c11db7 if crc & 0x80000000 else crc << 1) & 0xffffffff
+    return crc
+
+
+def ogg_raw_page(seq, lacing, body, kind=0):
+    page = b'OggS\0' + bytes([kind]) + struct.pack('<qII', 0, 0x5aab, seq) + b'\0\0\0\0'
+    page += bytes([len(lacing)]) + lacing + body
+    return page[:22] + struct.pack('<I', ogg_crc(page)) + page[26:]
+
+
+def ogg_page(seq, packets, kind=0):
+    lacing = b''
+    for p in packets:
+        lacing += b'\xff' * (len(p) // 255) + bytes([len(p) % 255])
+    return ogg_raw_page(seq, lacing, b''.join(packets), kind)
+
+
+def ogg(comment, per_page=None):
+    ident = b'\x01vorbis' + bytes(23)
+    comment = b'\x03vorbis' + comment + b'\x01'
+    setup = b'\x05vorbis' + audio(300, 2)
+    data = ogg_page(0, [ident], 2)
+
+    # a long comment packet continues over pages of per_page full segments
+    seq, kind = 1, 0
+    while per_page and len(comment) > 255 * per_page:
+        data += ogg_raw_page(seq, b'\xff' * per_page, comment[:255 * per_page], kind)
+        comment = comment[255 * per_page:]
+        seq, kind = seq + 1, 1
+    data += ogg_page(seq, [comment, setup], kind)
+
+    data += ogg_page(seq + 1, [audio(1000, 3)])
+    data += ogg_page(seq + 2, [audio(900, 4)], 4)
+    return data
+
+
+# MP4
+
+
+def atom(kind, body):
+    return struct.pack('>I', 8 + len(body)) + kind + body
+
+
+def itunes(kind, text):
+    return atom(kind, atom(b'data', b'\0\0\0\x01\0\0\0\0' + text))
+
+
+def moov(items):
+    meta = atom(b'meta', b'\0\0\0\0' + atom(b'hdlr', bytes(25)) + atom(b'ilst', b''.join(items)))
+    return atom(b'moov', atom(b'mvhd', bytes(100)) + atom(b'udta', meta))
+
+
+FTYP = atom(b'ftyp', b'M4A \0\0\0\0M4A mp42isom\0\0\0\0')
+
+
+# ASF
+
+
+def guid(text):
+    a, b, c, d, e = text.split('-')
+    return struct.pack('<IHH', int(a, 16), int(b, 16), int(c, 16)) + bytes.fromhex(d + e)
+
+
+ASF_HEADER = guid('75B22630-668E-11CF-A6D9-00AA0062CE6C')
+ASF_CONTENT = guid('75B22633-668E-11CF-A6D9-00AA0062CE6C')
+ASF_EXTENDED = guid('D2D0A440-E307-11D2-97F0-00A0C95EA850')
+ASF_PROPERTIES = guid('8CABDCA1-A947-11CF-8EE4-00C00C205365')
+ASF_DATA = guid('75B22636-668E-11CF-A6D9-00AA0062CE6C')
+
+
+def utf16(text):
+    return text.encode('utf-16-le') + b'\0\0'
+
+
+def asf_object(ident, body, size=None):
+    return ident + struct.pack('<Q', 24 + len(body) if size is None else size) + body
+
+
+def asf_content(title, author):
+    t, a = utf16(title), utf16(author)
+    return asf_object(ASF_CONTENT, struct.pack('<HHHHH', len(t), len(a), 0, 0, 0) + t + a)
+
+
+def asf_extended(descriptors):
+    body = struct.pack('<H', len(descriptors))
+    for name, kind, value in descriptors:
+        n = utf16(name) if isinstance(name, str) else name
+        body += struct.pack('<H', len(n)) + n + struct.pack('<HH', kind, len(value)) + value
+    return asf_object(ASF_EXTENDED, body)
+
+
+def asf(objects, count=None):
+    body = b''.join(objects)
+    header = ASF_HEADER + struct.pack('<QI', 30 + len(body), len(objects) if count is None else count) + b'\x01\x02'
+    data = asf_object(ASF_DATA, bytes(16) + struct.pack('<Q', 1) + b'\x01\x01' + audio(1200, 5))
+    return header + body + data
+
+
+# DSF
+
+
+def dsf(tags, pointer=None):
+    fmt = b'fmt ' + struct.pack('<Q', 52) + bytes(40)
+    samples = audio(1500, 6)
+    data = b'data' + struct.pack('<Q', 12 + len(samples)) + samples
+    head_size = 28
+    metadata = head_size + len(fmt) + len(data)
+    total = metadata + len(tags)
+    head = b'DSD ' + struct.pack('<QQQ', head_size, total, metadata if pointer is None else pointer)
+    return head + fmt + data + tags
+
+
+def corpus():
+    """(name, file, expected stream or None, (title, artist, album) or None)"""
+    frames = audio(1500)
+    files = []
+
+    # well formed, one of each type
+
+    tags = [id3_frame(b'TIT2', b'Title', 0), id3_frame(b'TPE1', 'Café “Quoted”'.encode()),
+            id3_frame(b'TALB', 'Album – Side A'.encode('utf-16'), 1)]
+    head = id3(tags)
+    files.append(('id3v23.mp3', head + frames, frames, ('Title', 'Cafe "Quoted"', 'Album - Side A')))
+
+    head = id3([id3_frame(b'TIT2', 'Naïve'.encode(), 3, 4), id3_frame(b'TPE1', b'Artist', 0, 4),
+                id3_frame(b'TALB', b'Album', 0, 4)], 4)
+    files.append(('id3v24.mp3', head + frames, frames, ('Naive', 'Artist', 'Album')))
+
+    head = id3([id3_frame(b'TT2', b'Old Title', 0, 2), id3_frame(b'TP1', b'Old Artist', 0, 2)], 2)
+    files.append(('id3v22.mp3', head + frames, frames, ('Old Title', 'Old Artist', '')))
+
+    files.append(('untagged.mp3', frames, frames, ('untagged.mp3', '', '')))
+
+    comments = vorbis_comments([b'TITLE=Flac Title', b'ARTIST=Flac Artist', b'album=Flac Album'])
+    data, stream = flac([flac_block(4, comments), flac_block(6, audio(2000, 7)), flac_block(1, bytes(100), True)],
+                        b'\xff\xf8' + frames)
+    files.append(('tagged.flac', data, stream, ('Flac Title', 'Flac Artist', 'Flac Album')))
+
+    data = ogg(vorbis_comments([b'TITLE=Ogg Title', b'ARTIST=Ogg Artist', b'ALBUM=Ogg Album']))
+    files.append(('tagged.ogg', data, data, ('Ogg Title', 'Ogg Artist', 'Ogg Album')))
+
+    # cover art takes the comment packet over several pages, all of them are sent
+    picture = b'METADATA_BLOCK_PICTURE=' + bytes(b'A'[0] + i % 26 for i in range(2400))
+    data = ogg(vorbis_comments([b'TITLE=Ogg Title', b'ARTIST=Ogg Artist', b'ALBUM=Ogg Album', picture]), 4)
+    files.append(('cover.ogg', data, data, ('Ogg Title', 'Ogg Artist', 'Ogg Album')))
+
+    mdat = atom(b'mdat', frames)
+    tags = moov([itunes(b'\xa9nam', b'Mp4 Title'), itunes(b'\xa9ART', b'Mp4 Artist'), itunes(b'\xa9alb', b'Mp4 Album')])
+    files.append(('moov_first.m4a', FTYP + tags + mdat, FTYP + tags + mdat, ('Mp4 Title', 'Mp4 Artist', 'Mp4 Album')))
+    files.append(('moov_last.m4a', FTYP + mdat + tags, FTYP + tags + mdat, ('Mp4 Title', 'Mp4 Artist', 'Mp4 Album')))
+
+    content = asf_content('Wma Title', 'Wma Artist')
+    props = asf_object(ASF_PROPERTIES, bytes(80))
+    plain = asf_extended([('WM/AlbumTitle', 0, utf16('Wma Album'))])
+    data = asf([props, content, plain])
+    files.append(('tagged.wma', data, data, ('Wma Title', 'Wma Artist', 'Wma Album')))
+
+    # the object holding cover art is left out and the header shrunk to match
+    art = asf_extended([('WM/AlbumTitle', 0, utf16('Wma Album')), ('WM/Picture', 1, audio(1400, 8))])
+    data = asf([props, content, art])
+    start = 30 + len(props) + len(content)
+    header = bytearray(data[:start])
+    struct.pack_into('<QI', header, 16, 30 + len(props) + len(content), 2)
+    files.append(('cover.wma', data, bytes(header) + data[start + len(art):], ('Wma Title', 'Wma Artist', 'Wma Album')))
+
+    # names without their terminator that start like WM/Picture or are empty are kept
+    short = asf_extended([(b'W\0M\0/\0', 1, audio(600, 9)), (b'', 1, audio(300, 10)),
+                          ('WM/AlbumTitle', 0, utf16('Wma Album'))])
+    data = asf([props, content, short])
+    files.append(('asf_short_name.wma', data, data, ('Wma Title', 'Wma Artist', 'Wma Album')))
+
+    data = dsf(id3([id3_frame(b'TIT2', b'Dsf Title', 0), id3_frame(b'TPE1', b'Dsf Artist', 0)]))
+    files.append(('tagged.dsf', data, data, ('Dsf Title', 'Dsf Artist', '')))
+
+    # malformed, these only have to finish
+
+    files.append(('empty.mp3', b'', b'', ('empty.mp3', '', '')))
+    files.append(('magic_only.flac', b'fLaC', None, None))
+
+    head = id3([id3_frame(b'TIT2', b'Kept', 0), b'TPE1' + struct.pack('>I', 0x10000) + b'\0\0\0Lost'])
+    files.append(('id3_frame_oversized.mp3', head + frames, None, ('Kept', '', '')))
+    files.append(('id3_header_truncated.mp3', id3([id3_frame(b'TIT2', b'Kept', 0)], 3, 0x0fffffff)[:40], None, None))
+    files.append(('id3_header_zero.mp3', id3([], 3, 0) + frames, None, None))
+
+    comments = vorbis_comments([b'TITLE=Counted'], 0xffffffff)
+    data, _ = flac([flac_block(4, comments, True)], frames)
+    files.append(('flac_comment_count.flac', data, None, ('Counted', '', '')))
+
+    comments = vorbis_comments([b'TITLE=Kept']) + struct.pack('<I', 0x7fffffff) + b'ARTIST=Lost'
+    comments = comments[:10] + struct.pack('<I', 2) + comments[14:]
+    data, _ = flac([flac_block(4, comments, True)], frames)
+    files.append(('flac_comment_oversized.flac', data, None, ('Kept', '', '')))
+
+    comments = vorbis_comments([b'NO EQUALS SIGN HERE', b'TITLE=After'])
+    data, _ = flac([flac_block(4, comments, True)], frames)
+    files.append(('flac_comment_no_equals.flac', data, None, ('After', '', '')))
+
+    data, _ = flac([flac_block(4, vorbis_comments([b'TITLE=Cut']), True)], frames)
+    files.append(('flac_truncated.flac', data[:60], None, None))
+
+    data = ogg(vorbis_comments([b'TITLE=Cut']))
+    files.append(('ogg_truncated.ogg', data[:80], None, None))
+
+    for name, size in (('mp4_atom_zero.m4a', 0), ('mp4_atom_small.m4a', 4), ('mp4_atom_oversized.m4a', 0xffffff00)):
+        bad = struct.pack('>I', size) + b'\xa9nam' + bytes(24)
+        files.append((name, FTYP + moov([itunes(b'\xa9ART', b'Kept'), bad]) + mdat, None, None))
+
+    bad = asf_object(ASF_PROPERTIES, bytes(80), 0)
+    files.append(('asf_object_zero.wma', asf([bad, content]), None, None))
+    bad = asf_object(ASF_PROPERTIES, bytes(80), 10)
+    files.append(('asf_object_small.wma', asf([bad, content]), None, None))
+    files.append(('asf_object_count.wma', asf([props, content], 0xffffffff), None, ('Wma Title', 'Wma Artist', '')))
+
+    files.append(('dsf_pointer_past_end.dsf', dsf(b'', 0x7fffff00), None, None))
+
+    return files
+
+
+def main():
+    with open(os.path.join(HERE, 'expected.txt'), 'w') as manifest:
+        manifest.write('# written by make.py: name, stream length and crc, title, artist, album\n')
+        for name, data, stream, tags in corpus():
+            with open(os.path.join(HERE, name), 'wb') as f:
+                f.write(data)
+            length, crc = ('-', '-') if stream is None else (str(len(stream)), '%04x' % crc_ccitt(stream))
+            manifest.write('\t'.join([name, length, crc] + list(tags or ('-', '-', '-'))) + '\n')
+
+
+if __name__ == '__main__':
+    main()
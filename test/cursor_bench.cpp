@@ -0,0 +1,68 @@
+// cost of reading the metadata of each well-formed corpus file, everything
+// AudioFile does before the first audio block: calls to File::read(), blocks
+// loaded into the cache, seeks, and host CPU cycles (the fewest of many runs,
+// nanoseconds off x86)
+
+#include <chrono>
+#include <string>
+#include <vector>
+#include "../AudioFile.h"
+
+#define RUNS 2000
+
+static std::string dir = "corpus/";
+
+
+static uint64_t now() {
+#if defined(__x86_64__) || defined(__i386__)
+  return __builtin_ia32_rdtsc();
+#else
+  return std::chrono::duration_cast<std::chrono::nanoseconds>(
+    std::chrono::steady_clock::now().time_since_epoch()).count();
+#endif
+}
+
+
+static void measure(const char *name) {
+  static AudioFile audio;
+  std::string path = dir + name;
+  host::SdStats stats;
+  uint64_t best = ~0ULL;
+
+  for (int i = 0; i < RUNS; i++) {
+    audio.close();
+    SdVolume::cacheClear();
+    memset(&host::sdStats, 0, sizeof(host::sdStats));
+
+    uint64_t start = now();
+    audio = SD.open(path.c_str());
+    uint8_t *buf;
+    while (audio.readMetadata(buf) > 0);
+    uint64_t cycles = now() - start;
+
+    best = min(best, cycles);
+    stats = host::sdStats;
+  }
+
+  printf("%-16s %6u %6u %6u %6u %8llu\n", name, stats.reads, stats.loads, stats.seeks, stats.rewinds,
+         (unsigned long long) best);
+}
+
+
+int main(int argc, char *argv[]) {
+  if (argc > 1) {
+    dir = std::string(argv[1]) + "/";
+  }
+
+  static const char *files[] = {
+    "id3v23.mp3", "id3v24.mp3", "id3v22.mp3", "tagged.flac", "tagged.ogg", "cover.ogg",
+    "moov_first.m4a", "moov_last.m4a", "tagged.wma", "cover.wma", "tagged.dsf"
+  };
+
+  printf("%-16s %6s %6s %6s %6s %8s\n", "file", "reads", "loads", "seeks", "back", "cycles");
+  for (size_t i = 0; i < sizeof(files) / sizeof(files[0]); i++) {
+    measure(files[i]);
+  }
+
+  return 0;
+}
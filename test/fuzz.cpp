@@ -0,0 +1,41 @@
+// libFuzzer target for the AudioFile parsers, any input has to be played in bounded time
+//   make fuzz && ./fuzz -max_len=8192 corpus
+// built without FUZZING, it plays the files named on the command line instead
+
+#include <vector>
+#include "play.h"
+
+// reads and seeks allowed per input, a few for every byte of a 64 KB file
+#define BUDGET 200000
+
+
+extern "C" int LLVMFuzzerTestOneInput(const uint8_t *data, size_t size) {
+  host::addFile("input", std::vector<uint8_t>(data, data + size));
+
+  host::sdBudget = BUDGET;
+  try {
+    play("input");
+  } catch (host::Hang) {
+    // a parser that doesn't finish is as bad as one that crashes
+    abort();
+  }
+  host::sdBudget = 0;
+
+  return 0;
+}
+
+
+#ifndef FUZZING
+int main(int argc, char *argv[]) {
+  for (int i = 1; i < argc; i++) {
+    File f = SD.open(argv[i]);
+    std::vector<uint8_t> data(f.size());
+    f.read(data.data(), data.size());
+
+    LLVMFuzzerTestOneInput(data.data(), data.size());
+  }
+
+  printf("fuzz_replay: %d files ok\n", argc - 1);
+  return 0;
+}
+#endif
@@ -0,0 +1,59 @@
+// reads a file the way VS1053::playTrack does, keeping what the codec would get
+#ifndef PLAY_H
+#define PLAY_H
+
+#include <string>
+#include <vector>
+#include "../AudioFile.h"
+
+struct Played {
+  std::vector<uint8_t> stream;
+  std::string tags[AudioFile::NUM_TAGS];
+  bool opened;
+};
+
+
+static void append(std::vector<uint8_t> &out, const uint8_t *buf, int n) {
+  out.insert(out.end(), buf, buf + n);
+}
+
+
+static Played play(const char *path) {
+  static AudioFile audio;
+  Played played;
+  uint8_t *buf;
+  int n;
+
+  audio.close();
+  audio = SD.open(path);
+  played.opened = audio;
+  if (!audio) {
+    return played;
+  }
+
+  // metadata, then audio until the file gives out
+  do {
+    n = audio.readMetadata(buf);
+    append(played.stream, buf, n);
+  } while (n > 0);
+
+  for (uint8_t i = 0; i < AudioFile::NUM_TAGS; i++) {
+    TagText tag = audio.getTag((AudioFile::Tag) i);
+    for (uint8_t j = 0; j < tag.length(); j++) {
+      played.tags[i] += tag[j];
+    }
+  }
+
+  while (audio) {
+    n = audio.readBlock(buf);
+    if (n > 0) {
+      append(played.stream, buf, n);
+    } else {
+      audio.close();
+    }
+  }
+
+  return played;
+}
+
+#endif // PLAY_H
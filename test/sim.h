@@ -0,0 +1,44 @@
+// puts tracks on the card of the board models and runs the sketch on them
+#ifndef SIM_H
+#define SIM_H
+
+#include <string>
+#include <vector>
+#include "board.h"
+
+void setup();
+void loop();
+
+static std::string dir = "corpus/";
+
+
+static std::vector<uint8_t> load(const std::string &path) {
+  File f = SD.open(path.c_str());
+  std::vector<uint8_t> data(f.size());
+  f.read(data.data(), data.size());
+  f.close();
+  return data;
+}
+
+
+// a corpus file followed by filler up to seconds of audio at rate, the parsers
+// only look at the start, so the codec gets the corpus stream and the filler
+static const host::Node *addTrack(Board &board, const char *path, const char *corpus,
+                                  uint32_t seconds, uint32_t rate, uint16_t reported) {
+  std::vector<uint8_t> data = load(dir + corpus);
+
+  for (uint32_t i = 0; i < seconds * rate; i++) {
+    data.push_back((i * 31 + 7 + (i >> 5)) & 0xff);
+  }
+
+  const host::Node *node = host::addFile(path, data);
+  board.setRate(node, rate, reported);
+  return node;
+}
+
+
+static void addPatch() {
+  host::addFile("/PATCH053.BIN", load("../data/patch053.bin"));
+}
+
+#endif // SIM_H
@@ -0,0 +1,134 @@
+// playback on the board models for each format and card, one tab separated line each:
+// format, card, the codec's byte rate, then for the first track the bytes/s the codec
+// got, ms it ran dry, % of the time the sketch was idle in the DREQ wait or asleep,
+// ms from selecting the CDC to its first byte, and ms from TRACK >> to the next track
+
+#include <sys/wait.h>
+#include <unistd.h>
+#include "sim.h"
+
+// seconds per track, and run until, long enough for three tracks on a card that keeps up
+#define SECONDS   3
+#define RUN_MS    12000
+
+// TRACK >> this far into the second track
+#define SKIP_MS   1000
+
+struct Format {
+  const char *name;
+  const char *corpus;
+  const char *path;
+  uint32_t rate;         // bytes per second
+  uint16_t reported;     // in XP_BYTERATE, a quarter of the rate for FLAC
+};
+
+static const Format formats[] = {
+  { "mp3-128",    "id3v23.mp3",     "/DISC1/TRACK%02u.MP3", 16000,  16000 },
+  { "mp3-320",    "id3v23.mp3",     "/DISC1/TRACK%02u.MP3", 40000,  40000 },
+  { "aac-256",    "moov_first.m4a", "/DISC1/TRACK%02u.M4A", 32000,  32000 },
+  { "vorbis-192", "tagged.ogg",     "/DISC1/TRACK%02u.OGG", 24000,  24000 },
+  { "wma-192",    "tagged.wma",     "/DISC1/TRACK%02u.WMA", 24000,  24000 },
+  { "flac-16/44", "tagged.flac",    "/DISC1/TRACK%02u.FLA", 110000, 27500 },
+  { "flac-24/96", "tagged.flac",    "/DISC1/TRACK%02u.FLA", 330000, 0xffff },
+  { "dsd64",      "tagged.dsf",     "/DISC1/TRACK%02u.DSF", 352800, 0 },
+};
+
+static const CardModel cards[] = {
+  { "class 10",   80000,  400,  1000, 64, false },
+  { "class 4",    250000, 1500, 4000, 64, false },
+  { "fragmented", 80000,  400,  1000, 8,  true },
+};
+
+// idle time as each stream starts
+static std::vector<uint64_t> idleAt;
+
+
+static void started(Board &board, size_t i) {
+  static const uint8_t press[] = { 0x00, 0x35 };
+  static const uint8_t release[] = { 0x00, 0x00 };
+
+  idleAt.push_back(board.waiting + board.asleep);
+  if (i == 1) {
+    board.inject(SKIP_MS, RX_CDC_CONTROL, press, sizeof(press));
+    board.inject(SKIP_MS + 100, RX_CDC_CONTROL, release, sizeof(release));
+  }
+}
+
+
+// first control frame with this button
+static const Board::Frame *pressed(const Board &board, uint8_t button) {
+  for (size_t i = 0; i < board.received.size(); i++) {
+    if (board.received[i].id == RX_CDC_CONTROL && board.received[i].data[1] == button) {
+      return &board.received[i];
+    }
+  }
+  return NULL;
+}
+
+
+static void measure(const Format &format, const CardModel &card) {
+  Board board(card);
+  addPatch();
+  for (uint8_t i = 1; i <= 3; i++) {
+    char path[32];
+    snprintf(path, sizeof(path), format.path, i);
+    addTrack(board, path, format.corpus, SECONDS, format.rate, format.reported);
+  }
+
+  if (!board.loadScript("scripts/start.txt")) {
+    return;
+  }
+  board.onStream = started;
+  board.run(setup, loop, RUN_MS);
+
+  printf("%s\t%s\t%u", format.name, card.name, format.rate);
+
+  if (board.streams.size() >= 2) {
+    const Board::Stream &first = board.streams[0];
+    uint64_t ns = first.end - first.start;
+    uint64_t idle = idleAt[1] - idleAt[0];
+    printf("\t%.0f\t%.1f\t%.1f", first.bytes * 1e9 / ns, first.starved / 1e6,
+           100.0 * idle / (board.streams[1].start - first.start));
+  } else {
+    printf("\t-\t-\t-");
+  }
+
+  const Board::Frame *select = pressed(board, 0x24);
+  if (select && board.streams.size() >= 1) {
+    printf("\t%.1f", (board.streams[0].start - select->at) / 1e6);
+  } else {
+    printf("\t-");
+  }
+
+  const Board::Frame *skip = pressed(board, 0x35);
+  if (skip && board.streams.size() >= 3) {
+    printf("\t%.1f\n", (board.streams[2].start - skip->at) / 1e6);
+  } else {
+    printf("\t-\n");
+  }
+}
+
+
+int main(int argc, char *argv[]) {
+  if (argc > 1) {
+    dir = std::string(argv[1]) + "/";
+  }
+
+  printf("format\tcard\trate\tbytes/s\tstarved ms\tidle %%\tstart ms\tskip ms\n");
+  for (size_t i = 0; i < sizeof(formats) / sizeof(formats[0]); i++) {
+    for (size_t j = 0; j < sizeof(cards) / sizeof(cards[0]); j++) {
+      fflush(stdout);
+
+      // each on a freshly started sketch
+      pid_t pid = fork();
+      if (pid == 0) {
+        measure(formats[i], cards[j]);
+        fflush(stdout);
+        _exit(0);
+      }
+      waitpid(pid, NULL, 0);
+    }
+  }
+
+  return 0;
+}
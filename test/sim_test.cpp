@@ -0,0 +1,278 @@
+// the whole sketch on the board models, playback, skips and replies in simulated time
+
+#include <signal.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#include <string>
+#include "check.h"
+#include "sim.h"
+#include "../Latency.h"
+
+// seconds per scenario, for loops that never move the clock
+#define WATCHDOG 60
+
+// a card that keeps up, and frames that must not take longer to answer
+static const CardModel card = { "class 10", 80000, 400, 1000, 64, false };
+
+
+// codec stream length of a corpus file
+static uint32_t streamLength(const char *name) {
+  FILE *f = fopen((dir + "expected.txt").c_str(), "r");
+  char line[256];
+  uint32_t length = 0;
+
+  while (f && fgets(line, sizeof(line), f)) {
+    size_t n = strlen(name);
+    if (!strncmp(line, name, n) && line[n] == '\t') {
+      length = strtoul(line + n + 1, NULL, 10);
+    }
+  }
+
+  if (f) {
+    fclose(f);
+  }
+  return length;
+}
+
+
+// codec stream length of a file's metadata, what goes out ahead of the audio blocks
+static uint32_t metadataLength(const char *path) {
+  static AudioFile audio;
+  uint32_t length = 0;
+  uint8_t *buf;
+  int n;
+
+  audio = SD.open(path);
+  do {
+    n = audio.readMetadata(buf);
+    length += n;
+  } while (n > 0);
+  audio.close();
+
+  // the card model charges for the blocks the sketch reads
+  SdVolume::cacheClear();
+  return length;
+}
+
+
+// moov_last.m4a with a 'free' atom at the end of its 'moov', the last atom,
+// so the metadata fills the codec's buffer many times over
+static const host::Node *addLongMetadata(Board &board, const char *path, uint32_t padding) {
+  std::vector<uint8_t> data = load(dir + "moov_last.m4a");
+  size_t moov = data.size() - 4;
+  while (moov > 0 && memcmp(&data[moov], "moov", 4)) {
+    moov--;
+  }
+  moov -= 4;
+
+  uint32_t size = BE8x4((&data[moov])) + padding;
+  for (uint8_t i = 0; i < 4; i++) {
+    data[moov + i] = size >> (24 - 8 * i);
+  }
+
+  const uint8_t free[8] = { (uint8_t) (padding >> 24), (uint8_t) (padding >> 16),
+                            (uint8_t) (padding >> 8), (uint8_t) padding, 'f', 'r', 'e', 'e' };
+  data.insert(data.end(), free, free + 8);
+  data.resize(data.size() + padding - 8);
+
+  const host::Node *node = host::addFile(path, data);
+  board.setRate(node, 16000, 16000);
+  return node;
+}
+
+
+// first frame with id sent after a received one
+static const Board::Frame *reply(const Board &board, const Board::Frame &to, uint16_t id) {
+  for (size_t i = 0; i < board.sent.size(); i++) {
+    if (board.sent[i].id == id && board.sent[i].requested >= to.at) {
+      return &board.sent[i];
+    }
+  }
+  return NULL;
+}
+
+
+// every power and control frame answered in time, by the bus and by Latency
+static void checkReplies(const Board &board) {
+  for (size_t i = 0; i < board.received.size(); i++) {
+    const Board::Frame &rx = board.received[i];
+    uint16_t id = (rx.id == RX_CDC_POWER) ? TX_CDC_POWER : (rx.id == RX_CDC_CONTROL) ? TX_CDC_CONTROL : 0;
+    if (id == 0) {
+      continue;
+    }
+
+    const Board::Frame *tx = reply(board, rx, id);
+    CHECK(tx != NULL);
+    if (tx && tx->requested - rx.at > LATENCY_DEADLINE * 1000ULL) {
+      printf("%03x at %llu ms: answered %llu us later\n", rx.id,
+             (unsigned long long) rx.at / 1000000, (unsigned long long) (tx->requested - rx.at) / 1000);
+      failures++;
+    }
+  }
+
+  for (uint8_t point = LatencyClass::Control; point <= LatencyClass::Power; point++) {
+    uint8_t stats[16];
+    uint16_t missed;
+    Latency.take(point, stats);
+    memcpy(&missed, &stats[2], 2);
+    CHECK_EQ(missed, 0);
+  }
+
+  CHECK_EQ(board.dropped, 0u);
+}
+
+
+// the fill sent after a track, up to the cancel being taken
+static uint32_t fill(bool high) {
+  return (high ? 384 : 64) * VS1053_BUFFER_SIZE + CANCEL_BYTES;
+}
+
+
+// two tracks played through while the SID asks for text
+static void testPlay() {
+  Board board(card);
+  addPatch();
+  const host::Node *first = addTrack(board, "/DISC1/TRACK01.MP3", "id3v23.mp3", 2, 16000, 16000);
+  const host::Node *second = addTrack(board, "/DISC1/TRACK02.FLA", "tagged.flac", 2, 100000, 25000);
+  addTrack(board, "/DISC1/TRACK03.OGG", "tagged.ogg", 2, 24000, 24000);
+
+  CHECK(board.loadScript("scripts/play.txt"));
+  board.run(setup, loop, 7000);
+
+  CHECK(board.streams.size() >= 3);
+  if (board.streams.size() >= 3) {
+    CHECK(board.streams[0].file == first);
+    CHECK(board.streams[1].file == second);
+    CHECK_EQ(board.streams[0].bytes, streamLength("id3v23.mp3") + 2 * 16000 + fill(false));
+    CHECK_EQ(board.streams[1].bytes, streamLength("tagged.flac") + 2 * 100000 + fill(true));
+
+    // the first track waits to be selected, after that the codec never runs dry
+    CHECK_EQ(board.streams[1].starved, 0u);
+    CHECK(board.streams[2].start - board.streams[1].end < 100000000ULL);
+  }
+
+  CHECK_EQ(board.overflows, 0u);
+  CHECK(board.waiting > 0);
+  checkReplies(board);
+}
+
+
+static const Board::Frame *skipAt;
+
+// TRACK >> as the first track's metadata starts to go out, it arrives while
+// the sketch waits for DREQ to send more of it
+static void skipInMetadata(Board &board, size_t i) {
+  static const uint8_t press[] = { 0x00, 0x35 };
+  static const uint8_t release[] = { 0x00, 0x00 };
+
+  if (i == 0) {
+    board.inject(0, RX_CDC_CONTROL, press, sizeof(press));
+    board.inject(100, RX_CDC_CONTROL, release, sizeof(release));
+  }
+}
+
+
+// a skip during the metadata is held until the audio, then changes track
+static void testSkipInMetadata() {
+  Board board(card);
+  addPatch();
+  addLongMetadata(board, "/DISC1/TRACK01.M4A", 4096);
+  const host::Node *second = addTrack(board, "/DISC1/TRACK02.MP3", "id3v23.mp3", 1, 16000, 16000);
+
+  CHECK(board.loadScript("scripts/start.txt"));
+  board.onStream = skipInMetadata;
+  uint32_t metadata = metadataLength("/DISC1/TRACK01.M4A");
+  host::sdStats.closed = 0;
+  board.run(setup, loop, 3000);
+
+  for (size_t i = 0; i < board.received.size() && !skipAt; i++) {
+    if (board.received[i].id == RX_CDC_CONTROL && board.received[i].data[1] == 0x35) {
+      skipAt = &board.received[i];
+    }
+  }
+
+  CHECK(skipAt != NULL);
+  CHECK(board.streams.size() >= 2);
+  if (skipAt && board.streams.size() >= 2) {
+    // the whole metadata, then no more than a block of audio before the fill
+    uint32_t cut = board.streams[0].bytes - fill(false);
+    CHECK(cut >= metadata);
+    CHECK(cut <= metadata + 512);
+
+    CHECK(board.streams[1].file == second);
+    CHECK(board.streams[1].start - skipAt->at < 500000000ULL);
+  }
+
+  // nothing read from the track once it was closed
+  CHECK_EQ(host::sdStats.closed, 0u);
+  CHECK_EQ(board.overflows, 0u);
+  checkReplies(board);
+}
+
+
+// power off as the first track's metadata starts to go out
+static void offInMetadata(Board &board, size_t i) {
+  static const uint8_t off[] = { 0x00, 0x00, 0x00, 0x08 };
+
+  if (i == 0) {
+    board.inject(0, RX_CDC_POWER, off, sizeof(off));
+  }
+}
+
+
+// power off gives up on the metadata and stops the codec
+static void testOffInMetadata() {
+  Board board(card);
+  addPatch();
+  addLongMetadata(board, "/DISC1/TRACK01.M4A", 4096);
+
+  CHECK(board.loadScript("scripts/start.txt"));
+  board.onStream = offInMetadata;
+  uint32_t metadata = metadataLength("/DISC1/TRACK01.M4A");
+  board.run(setup, loop, 3000);
+
+  CHECK_EQ(board.streams.size(), 1u);
+  if (board.streams.size() == 1) {
+    CHECK(board.streams[0].end > 0);
+    CHECK(board.streams[0].bytes - fill(false) < metadata);
+  }
+  CHECK_EQ(host::pins[VS1053_XRESET], LOW);
+  checkReplies(board);
+}
+
+
+// each scenario gets a freshly started sketch
+static void scenario(const char *name, void (*test)()) {
+  fflush(stdout);
+
+  pid_t pid = fork();
+  if (pid == 0) {
+    failures = 0;
+    alarm(WATCHDOG);
+    test();
+    if (failures) {
+      printf("  in %s\n", name);
+    }
+    fflush(stdout);
+    _exit(failures ? 1 : 0);
+  }
+
+  int status;
+  waitpid(pid, &status, 0);
+  if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+    failures++;
+  }
+}
+
+
+int main(int argc, char *argv[]) {
+  if (argc > 1) {
+    dir = std::string(argv[1]) + "/";
+  }
+
+  scenario("play", testPlay);
+  scenario("skip in metadata", testSkipInMetadata);
+  scenario("power off in metadata", testOffInMetadata);
+
+  return report("sim_test");
+}
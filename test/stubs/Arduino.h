@@ -0,0 +1,100 @@
+// host stand-in for the parts of the Arduino core the sketch sources use
+#ifndef ARDUINO_H
+#define ARDUINO_H
+
+// standard headers first, the min and max macros below would break them
+#include <stdint.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <memory>
+#include <string>
+#include <vector>
+#include <avr/pgmspace.h>
+
+typedef uint8_t byte;
+class __FlashStringHelper;
+#define F(s) ((const __FlashStringHelper *) (s))
+
+#define HIGH 1
+#define LOW 0
+#define INPUT 0
+#define OUTPUT 1
+#define MSBFIRST 1
+#define SPI_MODE0 0x00
+#define F_CPU 16000000UL
+
+#define _BV(b) (1u << (b))
+#define bit_is_set(v, b) ((v) & _BV(b))
+#define bit_is_clear(v, b) (!((v) & _BV(b)))
+#define digitalPinToInterrupt(p) ((p) - 2)
+
+#define min(a, b) ((a) < (b) ? (a) : (b))
+#define max(a, b) ((a) > (b) ? (a) : (b))
+
+void pinMode(uint8_t pin, uint8_t mode);
+void digitalWrite(uint8_t pin, uint8_t val);
+int digitalRead(uint8_t pin);
+int analogRead(uint8_t pin);
+void delay(unsigned long ms);
+void delayMicroseconds(unsigned int us);
+unsigned long millis();
+unsigned long micros();
+void attachInterrupt(uint8_t n, void (*handler)(), int mode);
+void detachInterrupt(uint8_t n);
+
+// SPI data register, bytes written go to the capture of the selected pin,
+// reads give the byte that came back
+struct SpiRegister {
+  SpiRegister &operator=(uint8_t c);
+  operator uint8_t() const;
+};
+extern SpiRegister SPDR;
+
+// transfers complete at once
+#define SPSR 0x80
+#define SPIF 7
+
+// host side of the pins and the SPI bus
+//   - pins read back what was written, XDREQ-style inputs read HIGH
+//   - bytes sent while pin spiCapturePin is LOW are kept in spiCapture
+//   - clock is in microseconds and only moves on in delays
+namespace host {
+  extern uint8_t pins[32];
+  extern uint8_t spiCapturePin;
+  extern std::vector<uint8_t> spiCapture;
+  extern unsigned long clock;
+  uint8_t transfer(uint8_t c);
+
+  // attached external interrupts, the ones SPI transactions hold off,
+  // and the clock of the open transaction, 0 outside of one
+  extern void (*handlers[2])();
+  extern uint8_t spiInterrupts;
+  extern uint32_t spiClock;
+
+  struct Node;
+
+  // timed model of the chips behind the pins and the bus, see board.h,
+  // when one is set it keeps the clock and everything above goes through it
+  class Board
+  {
+    public:
+      virtual uint8_t transfer(uint8_t c) = 0;
+      virtual uint8_t read(uint8_t pin) = 0;
+      virtual void written(uint8_t pin) = 0;
+      virtual void wait(unsigned long us) = 0;
+      virtual void sleep() = 0;
+
+      // an SPI transaction ended, what it held off can now interrupt
+      virtual void released() = 0;
+
+      // card access, block is in the file or directory
+      virtual void cardInit() = 0;
+      virtual void cardRead(const Node *node, uint32_t block) = 0;
+  };
+  extern Board *board;
+}
+
+#endif // ARDUINO_H
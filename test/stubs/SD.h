@@ -0,0 +1,98 @@
+// host stand-in for the SD library
+//   - files are held in memory, opened from the host file system or added by the test
+//   - files added under an absolute path also make up the card's directory tree
+//   - one 512 byte block cache shared by every file, like SdVolume
+//   - block loads and seeks are counted, and a budget on them stops runaway parsers
+//   - a closed file still has its name, and its position is -1
+//   - fastDigitalRead() and fastDigitalWrite() come with it, through SdFat.h in the real one
+#ifndef SD_H
+#define SD_H
+
+#include <Arduino.h>
+#include <SPI.h>
+#include <utility/Sd2PinMap.h>
+
+#define FILE_READ 0x01
+
+namespace host {
+  struct Node {
+    std::string name;
+    std::vector<uint8_t> data;
+    bool directory;
+    std::vector<std::shared_ptr<const Node> > children;
+  };
+
+  // what the card was asked to do since the last reset
+  struct SdStats {
+    uint32_t reads;    // calls to read()
+    uint32_t loads;    // blocks read into the cache
+    uint32_t seeks;    // seeks that moved the position
+    uint32_t rewinds;  // seeks backwards, the FAT chain is walked from the start
+    uint32_t closed;   // reads, seeks and positions asked of a closed file
+  };
+  extern SdStats sdStats;
+
+  // reads and seeks left before Hang is thrown, 0 for no limit
+  extern uint32_t sdBudget;
+  struct Hang {};
+
+  // add a file held in memory, replacing one of the same name,
+  // a name starting with '/' puts it on the card's directory tree
+  const Node *addFile(const char *name, const std::vector<uint8_t> &data);
+}
+
+class SdVolume
+{
+  public:
+    static uint8_t *cacheClear();
+
+  private:
+    friend class File;
+    static uint8_t cache[512];
+    static const host::Node *cacheNode;
+    static uint32_t cacheBlock;
+    static void cacheLoad(const host::Node *node, uint32_t block);
+};
+
+class File
+{
+  public:
+    File() : pos(0) {}
+
+    int read();
+    int read(void *buf, uint16_t nbyte);
+    int available() { return node ? node->data.size() - pos : 0; }
+    bool seek(uint32_t to);
+    uint32_t position();
+    uint32_t size() { return node ? node->data.size() : 0; }
+    char *name() { return (char *) fileName.c_str(); }
+    void close() { node.reset(); }
+    operator bool() { return (bool) node; }
+
+    // directories list their entries in the order they were added
+    bool isDirectory() { return node && node->directory; }
+    File openNextFile(uint8_t mode = FILE_READ);
+    void rewindDirectory() { pos = 0; }
+
+  private:
+    friend class SDClass;
+    std::shared_ptr<const host::Node> node;
+    std::string fileName;
+    uint32_t pos;
+    int fetch();
+};
+
+class SDClass
+{
+  public:
+    bool begin(uint32_t clock, uint8_t cs);
+    void end() {}
+    File open(const char *path, uint8_t mode = FILE_READ);
+    File open(const __FlashStringHelper *path, uint8_t mode = FILE_READ) {
+      return open((const char *) path, mode);
+    }
+};
+
+extern SDClass SD;
+
+#endif // SD_H
@@ -0,0 +1,36 @@
+// host stand-in for the SPI library, transfers go to the capture and the board model
+#ifndef SPI_H
+#define SPI_H
+
+#include <Arduino.h>
+
+class SPISettings
+{
+  public:
+    SPISettings() : clock(4000000) {}
+    SPISettings(uint32_t clock, uint8_t bitOrder, uint8_t dataMode) : clock(clock) {}
+
+  private:
+    friend class SPIClass;
+    uint32_t clock;
+};
+
+class SPIClass
+{
+  public:
+    static void begin() {}
+    // 255 holds off every interrupt
+    static void usingInterrupt(uint8_t n) { host::spiInterrupts |= (n < 8) ? _BV(n) : 0xff; }
+    static void beginTransaction(SPISettings settings) { host::spiClock = settings.clock; }
+    static void endTransaction() {
+      host::spiClock = 0;
+      if (host::board) {
+        host::board->released();
+      }
+    }
+    static uint8_t transfer(uint8_t c) { return host::transfer(c); }
+};
+
+extern SPIClass SPI;
+
+#endif // SPI_H
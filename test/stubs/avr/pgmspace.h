@@ -0,0 +1,20 @@
+// host stand-in, program memory is ordinary memory
+#ifndef PGMSPACE_H
+#define PGMSPACE_H
+
+#include <stdint.h>
+#include <string.h>
+#include <strings.h>
+
+#define PROGMEM
+#define PSTR(s) (s)
+#define pgm_read_byte(a) (*(const uint8_t *) (a))
+#define pgm_read_byte_near(a) (*(const uint8_t *) (a))
+#define pgm_read_word_near(a) (*(const uint16_t *) (a))
+#define memcmp_P memcmp
+#define memcpy_P memcpy
+#define strcmp_P strcmp
+#define strncmp_P strncmp
+#define strncasecmp_P strncasecmp
+
+#endif // PGMSPACE_H
@@ -0,0 +1,11 @@
+// host stand-in, there is nothing to power down
+#ifndef POWER_H
+#define POWER_H
+
+#define power_adc_disable()
+#define power_timer1_disable()
+#define power_timer2_disable()
+#define power_twi_disable()
+#define power_usart0_disable()
+
+#endif // POWER_H
@@ -0,0 +1,17 @@
+// host stand-in, sleeping is up to the board model if there is one
+#ifndef SLEEP_H
+#define SLEEP_H
+
+#include <Arduino.h>
+
+#define SLEEP_MODE_IDLE 0
+#define SLEEP_MODE_PWR_DOWN 2
+
+namespace host {
+  void sleep();
+}
+
+#define set_sleep_mode(mode)
+#define sleep_mode() host::sleep()
+
+#endif // SLEEP_H
@@ -0,0 +1,364 @@
+// host side of the Arduino, SD and SPI stand-ins
+
+#include <map>
+#include <Arduino.h>
+#include <SD.h>
+#include <SPI.h>
+#include <avr/sleep.h>
+
+namespace host {
+  uint8_t pins[32];
+  uint8_t spiCapturePin = 0xff;
+  std::vector<uint8_t> spiCapture;
+  unsigned long clock;
+
+  void (*handlers[2])();
+  uint8_t spiInterrupts;
+  uint32_t spiClock;
+  Board *board;
+
+  SdStats sdStats;
+  uint32_t sdBudget;
+
+  static std::map<std::string, std::shared_ptr<const Node> > files;
+  static std::shared_ptr<Node> root;
+
+  // last byte back from the bus
+  static uint8_t received;
+
+
+  uint8_t transfer(uint8_t c) {
+    if (spiCapturePin < sizeof(pins) && pins[spiCapturePin] == LOW) {
+      spiCapture.push_back(c);
+    }
+
+    received = board ? board->transfer(c) : 0;
+    return received;
+  }
+
+
+  void sleep() {
+    if (board) {
+      board->sleep();
+    }
+  }
+
+
+  static void spend() {
+    if (sdBudget != 0 && --sdBudget == 0) {
+      throw Hang();
+    }
+  }
+
+
+  // entry in dir, NULL if there isn't one
+  static std::shared_ptr<const Node> find(const Node *dir, const std::string &name) {
+    for (size_t i = 0; i < dir->children.size(); i++) {
+      if (dir->children[i]->name == name) {
+        return dir->children[i];
+      }
+    }
+    return NULL;
+  }
+
+
+  // link node into the tree at path, making the directories on the way
+  static void link(const char *path, const std::shared_ptr<const Node> &node) {
+    if (!root) {
+      root.reset(new Node());
+      root->directory = true;
+    }
+
+    Node *dir = root.get();
+
+    for (const char *slash; (slash = strchr(path, '/')) != NULL; path = slash + 1) {
+      if (slash == path) {
+        continue;
+      }
+
+      std::string name(path, slash - path);
+      std::shared_ptr<const Node> sub = find(dir, name);
+      if (!sub) {
+        std::shared_ptr<Node> made(new Node());
+        made->name = name;
+        made->directory = true;
+        dir->children.push_back(made);
+        sub = made;
+      }
+      dir = const_cast<Node *>(sub.get());
+    }
+
+    for (size_t i = 0; i < dir->children.size(); i++) {
+      if (dir->children[i]->name == node->name) {
+        dir->children[i] = node;
+        return;
+      }
+    }
+    dir->children.push_back(node);
+  }
+
+
+  // node at an absolute or root relative path on the tree
+  static std::shared_ptr<const Node> lookup(const char *path) {
+    std::shared_ptr<const Node> node = root;
+    if (!node) {
+      return node;
+    }
+
+    while (node && *path) {
+      const char *slash = strchr(path, '/');
+      size_t n = slash ? slash - path : strlen(path);
+      if (n > 0) {
+        node = find(node.get(), std::string(path, n));
+      }
+      path += slash ? n + 1 : n;
+    }
+
+    return node;
+  }
+
+
+  const Node *addFile(const char *name, const std::vector<uint8_t> &data) {
+    std::shared_ptr<Node> node(new Node());
+    const char *base = strrchr(name, '/');
+    node->name = base ? base + 1 : name;
+    node->data = data;
+
+    SdVolume::cacheClear();
+    files[name] = node;
+    if (name[0] == '/') {
+      link(name, node);
+    }
+    return node.get();
+  }
+}
+
+SPIClass SPI;
+SDClass SD;
+SpiRegister SPDR;
+
+
+SpiRegister &SpiRegister::operator=(uint8_t c) {
+  host::transfer(c);
+  return *this;
+}
+
+
+SpiRegister::operator uint8_t() const {
+  return host::received;
+}
+
+
+void pinMode(uint8_t pin, uint8_t mode) {
+  // inputs idle high, the codec always wants data
+  if (mode == INPUT) {
+    host::pins[pin] = HIGH;
+  }
+}
+
+
+void digitalWrite(uint8_t pin, uint8_t val) {
+  host::pins[pin] = val;
+  if (host::board) {
+    host::board->written(pin);
+  }
+}
+
+
+int digitalRead(uint8_t pin) {
+  return host::board ? host::board->read(pin) : host::pins[pin];
+}
+
+
+int analogRead(uint8_t pin) {
+  return 0;
+}
+
+
+void delay(unsigned long ms) {
+  delayMicroseconds(ms * 1000);
+}
+
+
+void delayMicroseconds(unsigned int us) {
+  if (host::board) {
+    host::board->wait(us);
+  } else {
+    host::clock += us;
+  }
+}
+
+
+unsigned long millis() {
+  return host::clock / 1000;
+}
+
+
+unsigned long micros() {
+  return host::clock;
+}
+
+
+void attachInterrupt(uint8_t n, void (*handler)(), int mode) {
+  host::handlers[n] = handler;
+}
+
+
+void detachInterrupt(uint8_t n) {
+  host::handlers[n] = NULL;
+}
+
+
+uint8_t SdVolume::cache[512];
+const host::Node *SdVolume::cacheNode;
+uint32_t SdVolume::cacheBlock;
+
+
+uint8_t *SdVolume::cacheClear() {
+  cacheNode = NULL;
+  return cache;
+}
+
+
+void SdVolume::cacheLoad(const host::Node *node, uint32_t block) {
+  if (cacheNode == node && cacheBlock == block) {
+    return;
+  }
+
+  if (host::board) {
+    host::board->cardRead(node, block);
+  }
+
+  uint32_t start = block * 512;
+  uint32_t n = min(node->data.size() - start, (size_t) 512);
+  memcpy(cache, node->data.data() + start, n);
+  cacheNode = node;
+  cacheBlock = block;
+  host::sdStats.loads++;
+}
+
+
+int File::read() {
+  host::sdStats.reads++;
+  return fetch();
+}
+
+
+int File::fetch() {
+  host::spend();
+  if (!node) {
+    host::sdStats.closed++;
+    return -1;
+  }
+  if (pos >= node->data.size()) {
+    return -1;
+  }
+
+  SdVolume::cacheLoad(node.get(), pos / 512);
+  return SdVolume::cache[pos++ % 512];
+}
+
+
+int File::read(void *buf, uint16_t nbyte) {
+  uint8_t *dst = (uint8_t *) buf;
+  uint16_t n = 0;
+
+  host::sdStats.reads++;
+  while (n < nbyte) {
+    int c = fetch();
+    if (c < 0) {
+      break;
+    }
+    dst[n++] = c;
+  }
+
+  return n;
+}
+
+
+bool File::seek(uint32_t to) {
+  host::spend();
+  if (!node) {
+    host::sdStats.closed++;
+    return false;
+  }
+  if (to > node->data.size()) {
+    return false;
+  }
+
+  if (to != pos) {
+    host::sdStats.seeks++;
+    if (to < pos) {
+      host::sdStats.rewinds++;
+    }
+  }
+
+  pos = to;
+  return true;
+}
+
+
+uint32_t File::position() {
+  if (!node) {
+    host::sdStats.closed++;
+    return -1;
+  }
+  return pos;
+}
+
+
+File File::openNextFile(uint8_t mode) {
+  File file;
+
+  if (isDirectory() && pos < node->children.size()) {
+    // 16 directory entries to a block
+    if (host::board && pos % 16 == 0) {
+      host::board->cardRead(node.get(), pos / 16);
+    }
+
+    file.node = node->children[pos++];
+    file.fileName = file.node->name;
+  }
+
+  return file;
+}
+
+
+bool SDClass::begin(uint32_t clock, uint8_t cs) {
+  if (host::board) {
+    host::board->cardInit();
+  }
+  return true;
+}
+
+
+File SDClass::open(const char *path, uint8_t mode) {
+  File file;
+
+  if (!host::files.count(path)) {
+    // the card's tree, then the host file system
+    file.node = host::lookup(path);
+    if (file.node) {
+      file.fileName = file.node->name;
+      return file;
+    }
+
+    FILE *f = fopen(path, "rb");
+    if (!f) {
+      return file;
+    }
+
+    std::vector<uint8_t> data;
+    int c;
+    while ((c = fgetc(f)) != EOF) {
+      data.push_back(c);
+    }
+    fclose(f);
+
+    host::addFile(path, data);
+  }
+
+  file.node = host::files[path];
+  file.fileName = file.node->name;
+  return file;
+}
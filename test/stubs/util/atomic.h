@@ -0,0 +1,9 @@
+// host stand-in, nothing interrupts the tests
+#ifndef ATOMIC_H
+#define ATOMIC_H
+
+#define ATOMIC_RESTORESTATE 0
+#define ATOMIC_FORCEON 0
+#define ATOMIC_BLOCK(type) for (int atomic_once = 1; atomic_once; atomic_once = 0)
+
+#endif // ATOMIC_H
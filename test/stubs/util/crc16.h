@@ -0,0 +1,14 @@
+// host stand-in, the C equivalent given in the avr-libc manual
+#ifndef CRC16_H
+#define CRC16_H
+
+#include <stdint.h>
+
+static inline uint16_t _crc_ccitt_update(uint16_t crc, uint8_t data) {
+  data ^= crc & 0xff;
+  data ^= data << 4;
+
+  return ((((uint16_t) data << 8) | (crc >> 8)) ^ (uint8_t) (data >> 4) ^ ((uint16_t) data << 3));
+}
+
+#endif // CRC16_H
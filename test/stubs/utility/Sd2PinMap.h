@@ -0,0 +1,10 @@
+// host stand-in, pins are plain memory
+#ifndef SD2PINMAP_H
+#define SD2PINMAP_H
+
+#include <Arduino.h>
+
+static inline void fastDigitalWrite(uint8_t pin, uint8_t value) { digitalWrite(pin, value); }
+static inline uint8_t fastDigitalRead(uint8_t pin) { return digitalRead(pin); }
+
+#endif // SD2PINMAP_H